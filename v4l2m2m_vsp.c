@@ -4,54 +4,105 @@
  *  This program can be used and distributed without restrictions.
  */
 
+#define _GNU_SOURCE             /* CPU_SET(), pthread_setaffinity_np() */
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
 #include <string.h>
 #include <assert.h>
 
 #include <getopt.h>             /* getopt_long() */
+#include <pthread.h>
+#include <sched.h>
 
 #include <fcntl.h>              /* low-level i/o */
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <malloc.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <asm/types.h>          /* for videodev2.h */
 
 #include <linux/media.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
 #include <linux/videodev2.h>
 #include <linux/v4l2-subdev.h>
 #include <linux/v4l2-mediabus.h>
 
+#include "vsp_delta.h"
+#include "vsp_metrics.h"
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>            /* USDT probes */
+#define HAVE_SDT 1
+#endif
+#endif
+
 #define N_BUFFERS 2
+#define MAX_CPU_WORKERS 16
+#define WARMUP_FRAMES 4
+#define PREFAULT_STACK (256 * 1024)
+#define IO_ALIGN 4096
+#define DIRECT_STAGE (1024 * 1024)
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SCHED_FLAG_RESET_ON_FORK
+#define SCHED_FLAG_RESET_ON_FORK 0x01
+#endif
 #define CLEAR(x) memset (&(x), 0, sizeof (x))
 
 typedef enum {
         IO_METHOD_READ,
         IO_METHOD_MMAP,
         IO_METHOD_USERPTR,
+        IO_METHOD_DMABUF,
 } io_method;
 
 struct buffer {
         void *                  start;
         size_t                  length;
+        struct pool_buf *       pb;		/* IO_METHOD_DMABUF */
 };
 
 enum {
 	OUT = 0,
 	CAP = 1,
 	RESZ = 2,
+	LUT = 3,
+	HGO = 4,
+	NR_ENTITIES,
 };
 
+/* vsp1 private controls */
+#ifndef V4L2_CID_VSP1_LUT_TABLE
+#define V4L2_CID_VSP1_LUT_TABLE		(V4L2_CID_USER_BASE | 0x1001)
+#endif
+#ifndef V4L2_CID_VSP1_CLU_TABLE
+#define V4L2_CID_VSP1_CLU_TABLE		(V4L2_CID_USER_BASE | 0x1101)
+#define V4L2_CID_VSP1_CLU_MODE		(V4L2_CID_USER_BASE | 0x1102)
+#endif
+#define LUT_SIZE 256
+#define CLU_SIZE (17 * 17 * 17)
+
 static char *           ip_name         = NULL;
 static char *           dev_name[2]     = { NULL, NULL };
-static char *           entity_name[3]    = { NULL, NULL, "uds.0" };
+static char *           entity_name[NR_ENTITIES] = { NULL, NULL, "uds.0", NULL, "hgo" };
 static io_method        io              = IO_METHOD_MMAP;
 static uint32_t		format[2]	= { V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_RGB565 };
 static enum v4l2_mbus_pixelcode code[2]	= { V4L2_MBUS_FMT_AYUV8_1X32, V4L2_MBUS_FMT_ARGB8888_1X32 };
@@ -60,15 +111,237 @@ static int		width[2]	= { 1280, 1280 };
 static int		height[2]	= { 720, 720 };
 static int              v4lout_fd       = -1;
 static int              v4lcap_fd       = -1;
-static int              v4lsub_fd[3]    = { -1, -1, -1 };
+static int              v4lsub_fd[NR_ENTITIES] = { -1, -1, -1, -1, -1 };
 static int              media_fd        = -1;
 static int              input_fd        = -1;
 static int              output_fd       = -1;
 struct buffer           buffers[2][N_BUFFERS][VIDEO_MAX_PLANES];
 struct v4l2_plane       planes[2][VIDEO_MAX_PLANES];
 static unsigned int     n_buffers[2]    = { 0, 0 };
-static const char *	ocstring[3]	= { "OUT" , "CAP", "RESZ" };
-static struct media_entity_desc entity[3];
+static const char *	ocstring[NR_ENTITIES] = { "OUT" , "CAP", "RESZ", "LUT", "HGO" };
+static struct media_entity_desc entity[NR_ENTITIES];
+static uint32_t         buf_caps[2]     = { 0, 0 };
+static struct v4l2_pix_format_mplane pix_fmt[2];
+static unsigned int     out_seq         = 0;
+static unsigned int     emit_seq        = 0;
+static unsigned int     n_workers       = 0;
+static double           latency_budget  = 0.033;
+static unsigned int     frame_count     = 100;
+static int              sw_device       = 0;
+static int              direct_io       = 0;
+static size_t           readahead_window = 0;
+static int              trace_fd        = -1;
+static int              rotation        = 0;
+static int              hflip           = 0;
+static int              vflip           = 0;
+static int              hw_orient       = 0;	/* the WPF rotates/flips */
+static uint8_t *        orient_buf      = NULL;
+static size_t           orient_len      = 0;
+static unsigned int     out_buf_seq[VIDEO_MAX_FRAME];
+
+/* --dedup: identical input frames repeat the previous output */
+static int              dedup           = 0;
+static int              have_hash       = 0;
+static uint64_t         last_hash       = 0;
+static unsigned int     n_dups          = 0;
+static uint8_t *        last_out        = NULL;	/* only with --direct */
+static size_t           last_out_len    = 0;
+static size_t           last_out_size   = 0;
+static off_t            last_out_off    = 0;	/* where it is in the output */
+static uint64_t         last_plane_hash[VIDEO_MAX_PLANES];
+static unsigned int     n_plane_hash    = 0;
+
+/* --regress: synthetic input, output checksummed or kept as golden frames */
+static int              regress         = 0;
+static uint64_t         out_hash        = 0;
+
+/* --delta: output frames coded against the previous one, see vsp_delta.h */
+static int              delta           = 0;
+static uint8_t *        delta_cur       = NULL;
+static uint8_t *        delta_ref       = NULL;
+static uint8_t *        delta_enc       = NULL;
+static size_t           delta_len       = 0;	/* frame size */
+static size_t           delta_pos       = 0;
+static uint64_t         delta_raw       = 0;
+
+/* --metrics: live counters, see vsp_metrics.h */
+static const char *     metrics_name    = NULL;
+static struct vsp_metrics * metrics     = NULL;
+static int              metrics_sock    = -1;
+
+#define METRIC_ADD(f, v)						\
+	do {								\
+		if (metrics)						\
+			vsp_metric_add (&metrics->f, (v));		\
+	} while (0)
+
+#define METRIC_SET(f, v)						\
+	do {								\
+		if (metrics)						\
+			vsp_metric_set (&metrics->f, (v));		\
+	} while (0)
+
+/*
+ * --shard: one process per VSP instance, each converting a range (or a
+ * round-robin share) of the frames at their offsets in the files.
+ */
+#define MAX_SHARDS	16
+
+static int              n_shards        = 0;	/* 0: off, -1: all found */
+static int              shard_rr        = 0;
+static unsigned int     shard_id        = 0;
+static unsigned int     shard_first     = 0;
+static unsigned int     shard_total     = 0;	/* instances in this run */
+
+/* --histogram: HGO statistics of every VSP frame to a sidecar file */
+#define HISTO_BUFFERS	4
+
+static const char *     histo_name      = NULL;
+static FILE *           histo_file      = NULL;
+static int              histo_fd        = -1;
+static int              histo_tap       = OUT;	/* entity feeding the HGO */
+static struct buffer    histo_buf[HISTO_BUFFERS];
+static unsigned int     n_histo_bufs    = 0;
+static unsigned int     histo_fifo[VIDEO_MAX_FRAME];	/* by pipeline sequence */
+static unsigned int     histo_head      = 0;	/* frames queued since STREAMON */
+static unsigned int     histo_seen      = 0;	/* histograms up to here came out */
+static unsigned int     histo_cap       = 0;	/* CAP buffers since STREAMON */
+static int              histo_skew      = 0;	/* CAP buf.sequence - histo_cap */
+static unsigned int     n_histos        = 0;
+
+/* recovery from EIO, error buffers and timeouts while streaming */
+#define RECOVER_RETRIES	3
+
+static int              recovering      = 0;
+static unsigned int     recover_streak  = 0;	/* since the last frame out */
+static unsigned int     n_recoveries    = 0;
+static unsigned int     n_relinks       = 0;
+static double           recover_sum     = 0.0;
+static double           recover_max     = 0.0;
+static unsigned int     redo_seq[VIDEO_MAX_FRAME];	/* to be queued again */
+static unsigned int     n_redo          = 0;
+
+/* where each frame in the VSP was read from, to read it again for re-queueing */
+static off_t            input_off[VIDEO_MAX_FRAME];
+
+/*
+ * Start-up profile. OUT and CAP are initialised on their own threads;
+ * the media device is looked up as soon as both have been probed, while
+ * the threads are still in S_FMT/REQBUFS/mmap.
+ */
+#define MAX_PHASES	16
+
+static struct {
+	const char *name;
+	double t;
+} phases[MAX_PHASES];
+static unsigned int     n_phases        = 0;
+static double           t_first         = 0.0;	/* first frame out */
+static double           t_init[2];		/* init_device() per queue */
+static pthread_mutex_t  init_lock       = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   init_cond       = PTHREAD_COND_INITIALIZER;
+static unsigned int     n_probed        = 0;
+
+/* --live: input paced at live_fps, stale frames dropped */
+static double           live_fps        = 0.0;
+static struct timespec  live_t0;
+static unsigned int     live_in         = 0;	/* input frames consumed */
+static unsigned int     live_drops      = 0;
+static unsigned int     live_misses     = 0;
+static double           live_svc        = 0.0;	/* queue to emit, EWMA */
+static double           live_lat_sum    = 0.0;
+static double           live_lat_max    = 0.0;
+static struct {
+	double due;		/* arrival + latency budget */
+	double arrival;
+	double queued;
+} live_frame[VIDEO_MAX_FRAME];
+
+/* run statistics, for --bench */
+static double           t_setup         = 0.0;
+static double           t_steady        = 0.0;
+static double           t_last          = 0.0;
+static double           cpu_time        = 0.0;
+static double *         lat_log         = NULL;
+static unsigned int     lat_n           = 0;
+static unsigned int     lat_max         = 0;
+
+/* real-time setup (-a, -A, -P, -L) */
+static cpu_set_t        main_cpus;
+static cpu_set_t        worker_cpus;
+static int              main_pinned     = 0;
+static int              worker_pinned   = 0;
+static int              sched_policy    = SCHED_OTHER;
+static int              sched_prio      = 0;
+static int              nice_value      = 0;	/* SCHED_OTHER */
+static uint64_t         dl_runtime      = 0;	/* ns */
+static uint64_t         dl_period       = 0;	/* ns */
+static int              lock_memory     = 0;
+static int              rt_report       = 0;
+
+/* wakeup latency: how late timed sleeps return, in 10 us buckets */
+#define WAKE_BUCKETS	1000
+
+static unsigned int     wake_hist[WAKE_BUCKETS];
+static unsigned int     wake_n          = 0;
+static double           wake_sum        = 0.0;
+static double           wake_max        = 0.0;
+
+/* frame interval jitter (includes the conversion time) */
+static double           ival_min        = 0.0;
+static double           ival_max        = 0.0;
+static double           ival_sum        = 0.0;
+static double           ival_sum2       = 0.0;
+static unsigned int     ival_n          = 0;
+static unsigned int     ival_late       = 0;
+
+/*
+ * per-frame parameters (-p), applied from 'frame' onwards. Output size
+ * changes need new CAP buffers, and LUT tables are swapped with -u and
+ * SIGHUP, so neither is a per-frame parameter.
+ */
+struct frame_param {
+	unsigned int frame;
+	struct v4l2_rect crop;	/* width == 0: leave the crop alone */
+	int alpha;		/* < 0: leave the alpha alone */
+};
+
+static struct frame_param *	params		= NULL;
+static unsigned int		n_params	= 0;
+static unsigned int		next_param	= 0;	/* the first not applied yet */
+static struct v4l2_rect		crop;		/* width == 0: the whole input */
+static int			use_requests	= 0;
+static int			request_fd[N_BUFFERS] = { -1, -1 };
+
+/* in-stream input format switches (-w), sorted by frame */
+struct format_switch {
+	unsigned int frame;
+	int width;
+	int height;
+	uint32_t format;
+	enum v4l2_mbus_pixelcode code;
+	int n_planes;
+};
+
+static struct format_switch *	switches	= NULL;
+static unsigned int		n_switches	= 0;
+static unsigned int		cur_switch	= 0;
+
+/* LUT/CLU tables (-u), double-buffered: 'lut_front' is in the hardware */
+static char *			lut_source	= NULL;
+static uint32_t *		lut_table[2]	= { NULL, NULL };
+static unsigned int		lut_entries	= 0;
+static int			lut_front	= 0;
+static int			lut_ready	= 0;	/* the back table holds a reload */
+static pthread_mutex_t		lut_lock	= PTHREAD_MUTEX_INITIALIZER;
+static int			lut_pipe[2]	= { -1, -1 };	/* SIGHUP -> lut_loader() */
+
+static void reconfigure (void);
+static void apply_due_params (void);
+static void read_histogram (void);
+static void swap_lut (void);
+static void list_formats(int fd, int index, enum v4l2_buf_type buftype);
+static void recover (int index, const char *why);
 
 static void
 errno_exit                      (const char *           s, const char *s2)
@@ -96,265 +369,2901 @@ xioctl                          (int                    fd,
         return r;
 }
 
+/*
+ * Trace points: a USDT probe vsp:<event> (when <sys/sdt.h> is available)
+ * and, with -T, a "vsp_<event>" line in the ftrace marker so that the
+ * events line up with the vsp1 driver's own. vsp-trace-timeline.py turns
+ * a trace into a per-frame timeline.
+ */
 static void
-process_image                   (const void *p, size_t len)
+trace_event                     (const char *ev, int q, int idx, int seq)
 {
-	printf("O %d bytes\n", len);
-        fflush (stdout);
-	if (output_fd >= 0)
-		write(output_fd, p, len);
+	char buf[96];
+	int n;
+
+	n = snprintf (buf, sizeof(buf), "vsp_%s q=%s idx=%d seq=%d\n", ev,
+		      (q >= 0 && q < NR_ENTITIES) ? ocstring[q] : "-", idx, seq);
+	if (write (trace_fd, buf, n) < 0)
+		trace_fd = -1;
 }
 
-static int
-read_frame                      (int fd, int index, enum v4l2_buf_type buftype)
+#ifdef HAVE_SDT
+#define TRACE_PROBE(ev, q, idx, seq)	DTRACE_PROBE3 (vsp, ev, q, idx, seq)
+#else
+#define TRACE_PROBE(ev, q, idx, seq)	do { } while (0)
+#endif
+
+#define TRACE(ev, q, idx, seq)						\
+	do {								\
+		TRACE_PROBE (ev, q, idx, seq);				\
+		if (trace_fd >= 0)					\
+			trace_event (#ev, q, idx, seq);			\
+	} while (0)
+
+static void
+open_trace                      (void)
 {
-        struct v4l2_buffer buf;
-        unsigned int i;
+	static const char *paths[] = {
+		"/sys/kernel/tracing/trace_marker",
+		"/sys/kernel/debug/tracing/trace_marker",
+	};
+	int i;
 
-        switch (io) {
-        case IO_METHOD_READ:
-                break;
+	for (i = 0; i < 2 && trace_fd < 0; i++)
+		trace_fd = open (paths[i], O_WRONLY);
+	if (trace_fd < 0)
+		errno_exit ("cannot open trace_marker", NULL);
+}
 
-        case IO_METHOD_MMAP:
-                CLEAR (buf);
+double gettimeofday_sec()
+{
+	struct timeval tv;
 
-                buf.type = buftype;
-                buf.memory = V4L2_MEMORY_MMAP;
-		buf.m.planes = planes[index];
-		buf.length = n_planes[index];
+	gettimeofday(&tv, NULL);
 
-                if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf)) {
-                        switch (errno) {
-                        case EAGAIN:
-                                return 0;
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
 
-                        case EIO:
-                                /* Could ignore EIO, see spec. */
+static double
+monotonic_sec                   (void)
+{
+	struct timespec ts;
 
-                                /* fall through */
+	clock_gettime (CLOCK_MONOTONIC, &ts);
 
-                        default:
-                                errno_exit ("VIDIOC_DQBUF for ", ocstring[index]);
-                        }
-                }
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-                assert (buf.index < n_buffers[index]);
+/*
+ * --metrics: the counters live in a shared memory page that vspstat maps,
+ * and a thread answers every connection to the metrics socket with a
+ * Prometheus snapshot of it. The frame path only does relaxed atomic
+ * updates, see vsp_metrics.h.
+ */
+static uint64_t
+monotonic_ns                    (void)
+{
+	struct timespec ts;
 
-		if (index == CAP) {
-			for (i=0; i<n_planes[index]; i++)
-				process_image (buffers[index][buf.index][i].start,
-					       buffers[index][buf.index][i].length);
-		        fputc ('I', stdout);
-			fflush (stdout);
-		} else if (input_fd >= 0 /* && (index == OUT) */) {
-			for (i=0; i<n_planes[index]; i++)
-				read(input_fd, buffers[index][buf.index][i].start,
-				     buffers[index][buf.index][i].length);
-		        fputc ('o', stdout);
-			fflush (stdout);
-		}
+	clock_gettime (CLOCK_MONOTONIC, &ts);
 
-                if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
-                        errno_exit ("VIDIOC_QBUF for ", ocstring[index]);
-                break;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-        case IO_METHOD_USERPTR:
-                break;
-        }
+static void *
+serve_metrics                   (void *arg)
+{
+	static const char head[] = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n\r\n";
+	struct timeval tv = { 0, 100000 };
+	char req[512], *body;
+	size_t len, size = 16384;
+	int fd;
 
-        return 1;
+	(void)arg;
+	body = malloc (size);
+	if (!body)
+		return NULL;
+
+	for (;;) {
+		fd = accept4 (metrics_sock, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		/* take the request, if any, but don't wait long for it */
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		if (recv (fd, req, sizeof(req), 0) < 0 && errno != EAGAIN)
+			goto next;
+
+		len = vsp_metrics_format (metrics, body, size);
+		if (send (fd, head, sizeof(head) - 1, MSG_NOSIGNAL) >= 0)
+			send (fd, body, len, MSG_NOSIGNAL);
+next:
+		close (fd);
+	}
+	free (body);
+
+	return NULL;
 }
 
 static void
-mainloop                        (void)
+open_metrics                    (const char *name)
 {
-        unsigned int count;
-
-        count = 100;
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	pthread_t thread;
+	char path[128];
+	int fd;
 
-        while (count-- > 0) {
-                for (;;) {
-                        fd_set fds;
-                        struct timeval tv;
-                        int r;
+	snprintf (path, sizeof(path), VSP_METRICS_SHM, name);
+	fd = shm_open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		errno_exit ("cannot create the metrics page ", path);
+	if (-1 == ftruncate (fd, sizeof(*metrics)))
+		errno_exit ("cannot size the metrics page ", path);
+	metrics = mmap (NULL, sizeof(*metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == metrics)
+		errno_exit ("cannot map the metrics page ", path);
+	close (fd);
+
+	metrics->version = VSP_METRICS_VERSION;
+	metrics->size = sizeof(*metrics);
+	metrics->pid = getpid ();
+	metrics->start_ns = monotonic_ns ();
+	__atomic_store_n (&metrics->magic, VSP_METRICS_MAGIC, __ATOMIC_RELEASE);
+
+	CLEAR (addr);
+	addr.sun_family = AF_UNIX;
+	snprintf (addr.sun_path + 1, sizeof(addr.sun_path) - 1, VSP_METRICS_SOCK, name);
+	addr_len = offsetof (struct sockaddr_un, sun_path) + 1 + strlen (addr.sun_path + 1);
+	metrics_sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (metrics_sock < 0 ||
+	    -1 == bind (metrics_sock, (struct sockaddr *)&addr, addr_len) ||
+	    -1 == listen (metrics_sock, 4))
+		errno_exit ("cannot listen on the metrics socket @", addr.sun_path + 1);
+
+	if (pthread_create (&thread, NULL, serve_metrics, NULL))
+		errno_exit ("cannot start the metrics thread", NULL);
+	pthread_detach (thread);
+
+	printf("metrics: /dev/shm%s, socket @%s\n", path, addr.sun_path + 1);
+}
 
-                        FD_ZERO (&fds);
-                        FD_SET (v4lcap_fd, &fds);
+static void
+close_metrics                   (void)
+{
+	char path[128];
 
-                        /* Timeout. */
-                        tv.tv_sec = 2;
-                        tv.tv_usec = 0;
+	if (!metrics)
+		return;
 
-                        r = select (v4lcap_fd + 1, &fds, NULL, NULL, &tv);
+	snprintf (path, sizeof(path), VSP_METRICS_SHM, metrics_name);
+	shm_unlink (path);
+	close (metrics_sock);
+}
 
-                        if (-1 == r) {
-                                if (EINTR == errno)
-                                        continue;
+/*
+ * Input/output file streams. Plain runs read and write straight through;
+ * with -o the files are opened O_DIRECT and go through an aligned
+ * staging buffer (or straight into aligned planes), with -R the page
+ * cache is told to read ahead one window and drop what is behind.
+ */
+struct file_stream {
+	int fd;
+	int writing;
+	int direct;
+	int staged;		/* the bypass hit memory O_DIRECT can't pin */
+	int seekable;		/* not a pipe, FIFO or terminal */
+	uint8_t *stage;
+	size_t size;		/* staging buffer, a multiple of IO_ALIGN */
+	size_t pos;		/* read: next byte to hand out, write: bytes staged */
+	size_t fill;		/* read: valid bytes staged */
+	off_t offset;		/* file offset of the next pread/pwrite */
+	off_t advised;		/* read ahead up to here */
+	off_t dropped;		/* dropped from the page cache up to here */
+	uint64_t bytes;
+	double busy;
+};
 
-                                errno_exit ("select for cap", NULL);
-                        }
+static struct file_stream	in_stream	= { .fd = -1 };
+static struct file_stream	out_stream	= { .fd = -1 };
+static struct file_stream	redo_stream	= { .fd = -1 };	/* shares in_stream's fd */
 
-                        if (0 == r) {
-                                fprintf (stderr, "select timeout\n");
-                                exit (EXIT_FAILURE);
-                        }
+static int
+open_stream                     (struct file_stream *s, const char *name, int writing)
+{
+	/* output is read back to repeat frames for --dedup */
+	int flags = writing ? (O_RDWR | O_CREAT) : O_RDONLY;
+
+	s->writing = writing;
+	s->direct = direct_io;
+	s->fd = open (name, flags | (direct_io ? O_DIRECT : 0), 0644);
+	if (s->fd < 0 && direct_io && errno == EINVAL) {
+		fprintf (stderr, "%s: O_DIRECT not supported, using the page cache\n", name);
+		s->direct = 0;
+		s->fd = open (name, flags, 0644);
+	}
+	if (s->fd < 0)
+		errno_exit ("cannot open ", name);
+	s->seekable = lseek (s->fd, 0, SEEK_CUR) >= 0;
+
+	if (s->direct) {
+		s->size = readahead_window ? readahead_window : DIRECT_STAGE;
+		s->size = (s->size + IO_ALIGN - 1) & ~(size_t)(IO_ALIGN - 1);
+		if (posix_memalign ((void **)&s->stage, IO_ALIGN, s->size))
+			errno_exit ("cannot allocate a staging buffer for ", name);
+	} else if (readahead_window) {
+		posix_fadvise (s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
 
-			/* dequeue a capture buffer and read it */
-			r = read_frame (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
-			if (!r)
-				continue; /* EAGAIN - continue select loop. */
+	return s->fd;
+}
 
-			/* dequeue an output buffer and refill it */
-			do {
-				r = read_frame (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-			} while (!r);
+/* the file offset the next stream_read() starts at */
+static off_t
+stream_tell                     (const struct file_stream *s)
+{
+	return s->offset - (off_t)(s->fill - s->pos);
+}
 
-			break;
-                }
-        }
-	printf("finishing...\n");
+/* make the next stream_read() start at off, O_DIRECT reads stay aligned */
+static void
+stream_seek                     (struct file_stream *s, off_t off)
+{
+	ssize_t r;
+
+	s->pos = s->fill = 0;
+	s->offset = s->direct ? off & ~(off_t)(IO_ALIGN - 1) : off;
+	if (s->offset == off)
+		return;
+
+	do
+		r = pread (s->fd, s->stage, s->size, s->offset);
+	while (r < 0 && errno == EINTR);
+	if (r < 0)
+		errno_exit ("read for input", NULL);
+	s->fill = r;
+	s->pos = off - s->offset < r ? (size_t)(off - s->offset) : (size_t)r;
+	s->offset += r;
 }
 
+/* keep one window read ahead, drop what is more than a window behind */
 static void
-stop_capturing                  (int fd, int index, enum v4l2_buf_type buftype)
+stream_advise                   (struct file_stream *s)
 {
-        switch (io) {
-        case IO_METHOD_READ:
-                /* Nothing to do. */
-                break;
+	off_t behind;
 
-        case IO_METHOD_MMAP:
-        case IO_METHOD_USERPTR:
+	if (s->direct || !readahead_window || !s->seekable)
+		return;
 
-		printf("stop streaming... ");fflush(stdout);
-                if (-1 == xioctl (fd, VIDIOC_STREAMOFF, &buftype))
-                        errno_exit ("VIDIOC_STREAMOFF for ", dev_name[index]);
-		printf("done.\n");
-                break;
-        }
+	if (!s->writing)
+		while (s->advised < s->offset + (off_t)readahead_window) {
+			posix_fadvise (s->fd, s->advised, readahead_window, POSIX_FADV_WILLNEED);
+			s->advised += readahead_window;
+		}
+
+	behind = s->offset - (off_t)readahead_window;
+	if (behind > s->dropped) {
+		if (s->writing)
+			sync_file_range (s->fd, s->dropped, behind - s->dropped,
+					 SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+					 SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise (s->fd, s->dropped, behind - s->dropped, POSIX_FADV_DONTNEED);
+		s->dropped = behind;
+	}
 }
 
-static void
-queue_buffers                (int fd, int index, enum v4l2_buf_type buftype)
+static ssize_t
+stream_read                     (struct file_stream *s, void *dst, size_t len)
 {
-        unsigned int i;
-
-        switch (io) {
-        case IO_METHOD_READ:
-                /* Nothing to do. */
-                break;
+	uint8_t *d = dst;
+	size_t n, done = 0;
+	ssize_t r;
+	double t = gettimeofday_sec ();
+
+	while (done < len) {
+		if (!s->direct) {
+			r = pread (s->fd, d + done, len - done, s->offset);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				errno_exit ("read for input", NULL);
+			if (!r)
+				break;
+			s->offset += r;
+			done += r;
+			stream_advise (s);
+			continue;
+		}
 
-        case IO_METHOD_MMAP:
-                for (i = 0; i < n_buffers[index]; ++i) {
-                        struct v4l2_buffer buf;
-			int j;
+		if (s->pos == s->fill) {
+			/*
+			 * aligned destination: skip the staging buffer. V4L2
+			 * MMAP planes (VM_PFNMAP) can't be pinned for
+			 * O_DIRECT and fail with EFAULT; stage from then on.
+			 */
+			n = (len - done) & ~(size_t)(IO_ALIGN - 1);
+			if (n && !s->staged && !((uintptr_t)(d + done) % IO_ALIGN)) {
+				r = pread (s->fd, d + done, n, s->offset);
+				if (r < 0 && errno == EFAULT) {
+					s->staged = 1;
+					continue;
+				}
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r < 0)
+					errno_exit ("read for input", NULL);
+				if (!r)
+					break;
+				s->offset += r;
+				done += r;
+				continue;
+			}
 
-                        CLEAR (buf);
+			r = pread (s->fd, s->stage, s->size, s->offset);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0)
+				errno_exit ("read for input", NULL);
+			if (!r)
+				break;
+			s->offset += r;
+			s->fill = r;
+			s->pos = 0;
+		}
 
-                        buf.type        = buftype;
-                        buf.memory      = V4L2_MEMORY_MMAP;
-                        buf.index       = i;
-			buf.m.planes    = planes[index];
-			buf.length      = n_planes[index];
+		n = s->fill - s->pos;
+		if (n > len - done)
+			n = len - done;
+		memcpy (d + done, s->stage + s->pos, n);
+		s->pos += n;
+		done += n;
+	}
 
-			if ((index == OUT) && (input_fd >= 0))
-				for (j=0; j<n_planes[index]; j++)
-					read(input_fd, buffers[index][i][j].start,
-					     buffers[index][i][j].length);
-                        if (-1 == xioctl (fd, VIDIOC_QBUF, &buf))
-                                errno_exit ("VIDIOC_QBUF for ", ocstring[index]);
-			else
-				printf("%s[%d] queued\n", ocstring[index], i);
-                }
+	s->bytes += done;
+	s->busy += gettimeofday_sec () - t;
 
-                break;
+	return done;
+}
 
-        case IO_METHOD_USERPTR:
-                break;
-        }
+/* write at off, or just append when the output can't seek */
+static void
+stream_put                      (struct file_stream *s, const void *src, size_t len, off_t off)
+{
+	const uint8_t *p = src;
+	ssize_t r;
+
+	while (len) {
+		r = s->seekable ? pwrite (s->fd, p, len, off) : write (s->fd, p, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			errno_exit ("write for output", NULL);
+		p += r;
+		off += r;
+		len -= r;
+	}
 }
 
 static void
-start_capturing                 (int fd, int index, enum v4l2_buf_type buftype)
+stream_flush                    (struct file_stream *s, int all)
 {
-        unsigned int i;
+	size_t n = s->pos & ~(size_t)(IO_ALIGN - 1);
+
+	if (all && n < s->pos) {
+		/* the unaligned tail can't go through O_DIRECT */
+		stream_put (s, s->stage, n, s->offset);
+		fcntl (s->fd, F_SETFL, fcntl (s->fd, F_GETFL) & ~O_DIRECT);
+		stream_put (s, s->stage + n, s->pos - n, s->offset + n);
+		fcntl (s->fd, F_SETFL, fcntl (s->fd, F_GETFL) | O_DIRECT);
+		s->offset += s->pos;
+		s->pos = 0;
+		return;
+	}
 
-        if (-1 == xioctl (fd, VIDIOC_STREAMON, &buftype))
-		errno_exit ("VIDIOC_STREAMON for ", ocstring[index]);
+	if (!n)
+		return;
+	stream_put (s, s->stage, n, s->offset);
+	s->offset += n;
+	memmove (s->stage, s->stage + n, s->pos - n);
+	s->pos -= n;
 }
 
 static void
-uninit_device                   (int index)
+stream_write                    (struct file_stream *s, const void *src, size_t len)
 {
-        unsigned int i, j;
+	const uint8_t *p = src;
+	size_t n;
+	double t = gettimeofday_sec ();
+
+	s->bytes += len;
+
+	if (!s->direct) {
+		stream_put (s, p, len, s->offset);
+		s->offset += len;
+		stream_advise (s);
+		s->busy += gettimeofday_sec () - t;
+		return;
+	}
 
-        switch (io) {
-        case IO_METHOD_READ:
-                break;
+	while (len) {
+		n = s->size - s->pos;
+		if (n > len)
+			n = len;
+		memcpy (s->stage + s->pos, p, n);
+		s->pos += n;
+		p += n;
+		len -= n;
+		if (s->pos == s->size)
+			stream_flush (s, 0);
+	}
+	s->busy += gettimeofday_sec () - t;
+}
 
-        case IO_METHOD_MMAP:
-		printf("unmapping ... ");
-                for (i = 0; i < n_buffers[index]; ++i) {
-			for (j = 0; j < n_planes[index]; ++j)
-				if (-1 == munmap (buffers[index][i][j].start, buffers[index][i][j].length))
-					errno_exit ("munmap for ", dev_name[index]);
-			printf("[%d] ", i);fflush(stdout);
-		}
-		printf("done.\n");
+/*
+ * Write 'len' bytes that are already in the file at 'src' again, without
+ * bringing them through user space when the filesystem can help.
+ */
+static void
+stream_repeat                   (struct file_stream *s, off_t src, size_t len)
+{
+	loff_t in = src, out = s->offset;
+	size_t left = len, n;
+	ssize_t r;
+	uint8_t buf[64 * 1024];
+	double t = gettimeofday_sec ();
+
+	while (left) {
+		r = copy_file_range (s->fd, &in, s->fd, &out, left, 0);
+		if (r <= 0)
+			break;
+		left -= r;
+	}
+	while (left) {
+		n = (left < sizeof(buf)) ? left : sizeof(buf);
+		r = pread (s->fd, buf, n, in);
+		if (r <= 0 || pwrite (s->fd, buf, r, out) != r)
+			errno_exit ("repeat in output", NULL);
+		in += r;
+		out += r;
+		left -= r;
+	}
 
-                break;
+	s->offset = out;
+	s->bytes += len;
+	stream_advise (s);
+	s->busy += gettimeofday_sec () - t;
+}
 
-        case IO_METHOD_USERPTR:
-                break;
-        }
+/* bytes of the file currently in the page cache */
+static size_t
+cached_bytes                    (int fd)
+{
+	struct stat st;
+	unsigned char *vec;
+	size_t pages, i, n = 0;
+	long pgsz = sysconf (_SC_PAGESIZE);
+	char path[64];
+	void *m;
+	int rfd;
+
+	snprintf (path, sizeof(path), "/proc/self/fd/%d", fd);
+	if ((rfd = open (path, O_RDONLY)) < 0)
+		return 0;
+	if (fstat (rfd, &st) || !st.st_size) {
+		close (rfd);
+		return 0;
+	}
+
+	pages = (st.st_size + pgsz - 1) / pgsz;
+	m = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, rfd, 0);
+	vec = malloc (pages);
+	if (m != MAP_FAILED && vec && !mincore (m, st.st_size, vec))
+		for (i = 0; i < pages; i++)
+			n += vec[i] & 1;
+	if (m != MAP_FAILED)
+		munmap (m, st.st_size);
+	free (vec);
+	close (rfd);
+
+	return n * pgsz;
 }
 
 static void
-init_mmap                       (int fd, int index, enum v4l2_buf_type buftype, int n_bufs)
+close_stream                    (struct file_stream *s, const char *what)
 {
-        struct v4l2_requestbuffers req;
+	if (s->fd < 0)
+		return;
+
+	if (s->writing && s->direct)
+		stream_flush (s, 1);
+
+	if (direct_io || readahead_window)
+		printf("%s: %.1f MB in %.3f s (%.1f MB/s)%s, %.1f MB in the page cache\n",
+		       what, s->bytes / 1e6, s->busy,
+		       s->busy > 0.0 ? s->bytes / 1e6 / s->busy : 0.0,
+		       s->direct ? " direct" : "",
+		       cached_bytes (s->fd) / 1e6);
+
+	close (s->fd);
+	free (s->stage);
+	s->stage = NULL;
+	s->fd = -1;
+}
 
-	/* input buffer */
-        CLEAR (req);
+/*
+ * P010 input, which the VSP can't take, is repacked to NV12 while it is
+ * read: rows are pread() in chunks into a small stage that stays in
+ * cache and converted straight into the OUT planes, so the frame is
+ * written to memory only once. The row kernel is a 16-byte vector
+ * shuffle with a scalar tail.
+ */
+#define REPACK_STAGE	(64 * 1024)
 
-        req.count               = n_bufs;
-        req.type                = buftype;
-        req.memory              = V4L2_MEMORY_MMAP;
+typedef uint8_t v16u8 __attribute__ ((vector_size (16)));
 
-        if (-1 == xioctl (fd, VIDIOC_REQBUFS, &req)) {
-                if (EINVAL == errno) {
-                        fprintf (stderr, "%s does not support "
-                                 "memory mapping\n", dev_name[index]);
-			errno_exit("VIDIOC_REQBUFS for ", dev_name[index]);
-                } else {
-                        errno_exit ("VIDIOC_REQBUFS for ", dev_name[index]);
-                }
-        }
+struct repack {
+	const char *name;
+	uint32_t fourcc;	/* what the OUT queue gets */
+	enum v4l2_mbus_pixelcode code;
+	int n_planes;
+	void (*row) (const uint8_t *src, uint8_t *dst, size_t n);
+};
 
-	printf("req.count = %d\n", req.count);
-	n_bufs = req.count;
+static const struct repack *	repack_fmt	= NULL;
+static uint8_t *		repack_stage	= NULL;
 
-        for (n_buffers[index] = 0; n_buffers[index] < n_bufs; ++n_buffers[index]) {
-                struct v4l2_buffer buf;
-		int i;
+/* P010: the 8 MSBs of each little-endian 16-bit sample; n output bytes */
+static void
+row_p010                        (const uint8_t *src, uint8_t *dst, size_t n)
+{
+	const v16u8 m = { 1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31 };
+	v16u8 a, b;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		memcpy (&a, src + 2 * i, 16);
+		memcpy (&b, src + 2 * i + 16, 16);
+		a = __builtin_shuffle (a, b, m);
+		memcpy (dst + i, &a, 16);
+	}
+	for (; i < n; i++)
+		dst[i] = src[2 * i + 1];
+}
 
-                CLEAR (buf);
-                memset((void *)planes[index], 0,
-		       sizeof(struct v4l2_plane) * VIDEO_MAX_PLANES);
+static const struct repack repacks[] = {
+	{ "P010", V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2, row_p010 },
+};
 
-                buf.type        = buftype;
-                buf.memory      = V4L2_MEMORY_MMAP;
-                buf.index       = n_buffers[index];
-		buf.m.planes    = planes[index];
-		buf.length      = n_planes[index];
+static const struct repack *
+find_repack                     (const char *name)
+{
+	unsigned int i;
 
-                if (-1 == xioctl (fd, VIDIOC_QUERYBUF, &buf))
-                        errno_exit ("VIDIOC_QUERYBUF for ", dev_name[index]);
+	for (i = 0; i < sizeof(repacks) / sizeof(repacks[0]); i++)
+		if (!strcasecmp (name, repacks[i].name))
+			return &repacks[i];
 
-		printf("n_planes = %d\n", buf.length);
-		n_planes[index] = buf.length;
-		for (i=0; i<n_planes[index]; i++) {
-			printf("m.plane[%d].length = %d, m.plane[%d].m.mem_offset = %08x\n",
+	return NULL;
+}
+
+/* bytes of one frame in the input file */
+static size_t
+input_frame_size                (const struct v4l2_pix_format_mplane *f)
+{
+	size_t luma = (size_t)f->width * f->height;
+	unsigned int i;
+	size_t len = 0;
+
+	if (repack_fmt)
+		return (luma + luma / 2) * 2;
+
+	for (i = 0; i < f->num_planes; i++)
+		len += f->plane_fmt[i].sizeimage;
+	return len;
+}
+
+/*
+ * 'rows' rows of 'in' bytes at file offset 'off', converted to 'out'
+ * bytes each into dst. Past the end of the file the rows are zero.
+ */
+static void
+repack_rows                     (struct file_stream *s, off_t off, size_t in,
+				 unsigned int rows, uint8_t *dst, size_t stride, size_t out)
+{
+	unsigned int r, k, n, chunk = REPACK_STAGE / in;
+	size_t got;
+	ssize_t ret;
+
+	if (!chunk)
+		errno_exit ("rows too long to repack", NULL);
+	for (r = 0; r < rows; r += n) {
+		n = (rows - r < chunk) ? rows - r : chunk;
+		for (got = 0; got < n * in; got += ret) {
+			ret = pread (s->fd, repack_stage + got, n * in - got,
+				     off + (off_t)r * in + got);
+			if (ret < 0 && errno == EINTR) {
+				ret = 0;
+				continue;
+			}
+			if (ret < 0)
+				errno_exit ("read for input", NULL);
+			if (!ret)
+				break;
+		}
+		memset (repack_stage + got, 0, n * in - got);
+		for (k = 0; k < n; k++)
+			repack_fmt->row (repack_stage + k * in,
+					 dst + (size_t)(r + k) * stride, out);
+	}
+}
+
+/* one frame from the stream into the OUT planes in f's layout */
+static void
+repack_frame                    (struct file_stream *s, uint8_t *const p[],
+				 const struct v4l2_pix_format_mplane *f)
+{
+	size_t w = f->width, h = f->height;
+	off_t base = s->offset;
+	double t = gettimeofday_sec ();
+
+	if (!repack_stage && posix_memalign ((void **)&repack_stage, IO_ALIGN, REPACK_STAGE))
+		errno_exit ("cannot allocate the repack stage", NULL);
+
+	/* Y plane, then the interleaved UV plane */
+	repack_rows (s, base, w * 2, h, p[0], f->plane_fmt[0].bytesperline, w);
+	repack_rows (s, base + w * h * 2, w * 2, h / 2, p[1],
+		     f->plane_fmt[1].bytesperline, w);
+
+	s->offset = base + input_frame_size (f);
+	s->bytes += input_frame_size (f);
+	stream_advise (s);
+	s->busy += gettimeofday_sec () - t;
+}
+
+typedef uint32_t v8u32 __attribute__ ((vector_size (32)));
+
+/*
+ * 8 x 32-bit multiply-xorshift lanes over 32-byte blocks, folded at the
+ * end. 32-bit lane multiplies exist in NEON as well as SSE/AVX, so this
+ * stays SIMD on the R-Car cores. Fast enough to run on every plane
+ * right after it was read, while it is still in cache.
+ */
+static uint64_t
+hash_bytes                      (const uint8_t *p, size_t len, uint64_t seed)
+{
+	const v8u32 k = { 0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f,
+			  0x165667b1, 0xd3a2646d, 0xfd7046c5, 0xb55a4f09 };
+	v8u32 h = { seed, seed >> 32, seed ^ 1, seed ^ 2,
+		    seed ^ 3, seed ^ 4, seed ^ 5, seed ^ 6 }, v;
+	uint64_t r = len;
+	size_t i;
+
+	for (i = 0; i + sizeof(v) <= len; i += sizeof(v)) {
+		memcpy (&v, p + i, sizeof(v));
+		h = (h ^ v) * k;
+		h ^= h >> 15;
+	}
+	for (; i < len; i++)
+		r = (r ^ p[i]) * 0x100000001b3ULL;
+	for (i = 0; i < 8; i++)
+		r = (r ^ h[i]) * 0x9e3779b97f4a7c15ULL;
+
+	return r ^ (r >> 29);
+}
+
+/* chain one plane's hash into the output checksum */
+static inline uint64_t
+fold_hash                       (uint64_t acc, uint64_t h)
+{
+	return (acc ^ h) * 0x9e3779b97f4a7c15ULL + (acc >> 31);
+}
+
+static inline int
+block_equal                     (const uint8_t *a, const uint8_t *b)
+{
+	v16u8 x, y;
+	uint64_t w[2];
+
+	memcpy (&x, a, sizeof(x));
+	memcpy (&y, b, sizeof(y));
+	x ^= y;
+	memcpy (w, &x, sizeof(w));
+
+	return !(w[0] | w[1]);
+}
+
+static inline int
+block_op                        (size_t pos)
+{
+	if (block_equal (delta_cur + pos, delta_ref + pos))
+		return VSP_DELTA_SKIP;
+	if (pos && block_equal (delta_cur + pos, delta_cur + pos - VSP_DELTA_BLOCK))
+		return VSP_DELTA_FILL;
+	return VSP_DELTA_COPY;
+}
+
+/* start collecting an output frame of 'len' bytes for --delta */
+static void
+delta_begin                     (size_t len)
+{
+	if (len != delta_len) {
+		free (delta_cur);
+		free (delta_ref);
+		free (delta_enc);
+		delta_cur = malloc (len);
+		delta_ref = calloc (1, len);
+		delta_enc = malloc (vsp_delta_bound (len));
+		if (!delta_cur || !delta_ref || !delta_enc)
+			errno_exit ("cannot allocate the delta buffers", NULL);
+		delta_len = len;
+	}
+	delta_pos = 0;
+}
+
+/* write the record coded into delta_enc up to 'end' */
+static void
+delta_record                    (const uint8_t *end)
+{
+	struct vsp_delta_hdr hdr;
+
+	hdr.magic = VSP_DELTA_MAGIC;
+	hdr.seq = emit_seq;
+	hdr.raw_len = delta_len;
+	hdr.enc_len = end - delta_enc;
+	stream_write (&out_stream, &hdr, sizeof(hdr));
+	stream_write (&out_stream, delta_enc, hdr.enc_len);
+	delta_raw += delta_len;
+}
+
+/*
+ * Code the collected frame against the previous one, in runs of blocks
+ * that are unchanged, repeat the block before or have to be copied.
+ */
+static void
+delta_end                       (void)
+{
+	size_t pos, n, blocks = delta_len / VSP_DELTA_BLOCK * VSP_DELTA_BLOCK;
+	uint8_t *d = delta_enc, *t;
+	int op;
+
+	for (pos = 0; pos < blocks; pos += n) {
+		op = block_op (pos);
+		for (n = VSP_DELTA_BLOCK; pos + n < blocks && block_op (pos + n) == op;
+		     n += VSP_DELTA_BLOCK)
+			;
+		d = vsp_delta_put (d, n / VSP_DELTA_BLOCK, op);
+		if (op == VSP_DELTA_COPY) {
+			memcpy (d, delta_cur + pos, n);
+			d += n;
+		}
+	}
+	memcpy (d, delta_cur + blocks, delta_len - blocks);
+	d += delta_len - blocks;
+	delta_record (d);
+
+	t = delta_ref;
+	delta_ref = delta_cur;
+	delta_cur = t;
+}
+
+/* the previous frame again: one run of unchanged blocks */
+static void
+delta_repeat                    (void)
+{
+	size_t blocks = delta_len / VSP_DELTA_BLOCK * VSP_DELTA_BLOCK;
+	uint8_t *d = delta_enc;
+
+	if (blocks)
+		d = vsp_delta_put (d, blocks / VSP_DELTA_BLOCK, VSP_DELTA_SKIP);
+	memcpy (d, delta_ref + blocks, delta_len - blocks);
+	d += delta_len - blocks;
+	delta_record (d);
+}
+
+static void
+process_image                   (const void *p, size_t len)
+{
+	printf("O %d bytes\n", len);
+        fflush (stdout);
+	if (regress) {
+		last_plane_hash[n_plane_hash] = hash_bytes (p, len, 0);
+		out_hash = fold_hash (out_hash, last_plane_hash[n_plane_hash++]);
+	}
+	METRIC_ADD (bytes_written, len);
+	if (output_fd >= 0 && delta) {
+		memcpy (delta_cur + delta_pos, p, len);
+		delta_pos += len;
+	} else if (output_fd >= 0)
+		stream_write (&out_stream, p, len);
+}
+
+/*
+ * Software conversion for the frames the scheduler hands to the CPU.
+ * Rows are unpacked to XRGB8888, resampled (nearest neighbour) and
+ * packed again. The per-pixel loops are branch-free so that gcc -O3
+ * vectorizes them for the host SIMD unit.
+ */
+static inline uint8_t
+clip8                           (int v)
+{
+	return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+static inline uint32_t
+yuv2rgb                         (int y, int u, int v)
+{
+	y = 298 * (y - 16) + 128;
+	u -= 128;
+	v -= 128;
+
+	return (clip8 ((y + 409 * v) >> 8) << 16) |
+	       (clip8 ((y - 100 * u - 208 * v) >> 8) << 8) |
+	       clip8 ((y + 516 * u) >> 8);
+}
+
+#define RGB_R(c)	(((c) >> 16) & 0xff)
+#define RGB_G(c)	(((c) >> 8) & 0xff)
+#define RGB_B(c)	((c) & 0xff)
+#define RGB_Y(c)	(((66 * RGB_R(c) + 129 * RGB_G(c) + 25 * RGB_B(c) + 128) >> 8) + 16)
+#define RGB_U(c)	(((-38 * RGB_R(c) - 74 * RGB_G(c) + 112 * RGB_B(c) + 128) >> 8) + 128)
+#define RGB_V(c)	(((112 * RGB_R(c) - 94 * RGB_G(c) - 18 * RGB_B(c) + 128) >> 8) + 128)
+
+static void
+sw_unpack_row                   (const struct v4l2_pix_format_mplane *f,
+				 uint8_t *const p[], int y, uint32_t * restrict o)
+{
+	const uint8_t *s = p[0] + y * f->plane_fmt[0].bytesperline;
+	const uint8_t *c, *u, *v;
+	int x, w = f->width;
+
+	switch (f->pixelformat) {
+	case V4L2_PIX_FMT_RGB565:
+		for (x = 0; x < w; x++) {
+			uint32_t d = s[2 * x] | (s[2 * x + 1] << 8);
+
+			o[x] = ((d & 0xf800) << 8) | ((d & 0xe000) << 3) |
+			       ((d & 0x07e0) << 5) | ((d & 0x0600) >> 1) |
+			       ((d & 0x001f) << 3) | ((d & 0x001c) >> 2);
+		}
+		break;
+	case V4L2_PIX_FMT_RGB24:
+		for (x = 0; x < w; x++)
+			o[x] = (s[3 * x] << 16) | (s[3 * x + 1] << 8) | s[3 * x + 2];
+		break;
+	case V4L2_PIX_FMT_BGR24:
+		for (x = 0; x < w; x++)
+			o[x] = (s[3 * x + 2] << 16) | (s[3 * x + 1] << 8) | s[3 * x];
+		break;
+	case V4L2_PIX_FMT_RGB32:
+		for (x = 0; x < w; x++)
+			o[x] = (s[4 * x + 2] << 16) | (s[4 * x + 1] << 8) | s[4 * x];
+		break;
+	case V4L2_PIX_FMT_UYVY:
+		for (x = 0; x < w; x++)
+			o[x] = yuv2rgb (s[2 * x + 1], s[4 * (x / 2)], s[4 * (x / 2) + 2]);
+		break;
+	case V4L2_PIX_FMT_YUYV:
+		for (x = 0; x < w; x++)
+			o[x] = yuv2rgb (s[2 * x], s[4 * (x / 2) + 1], s[4 * (x / 2) + 3]);
+		break;
+	case V4L2_PIX_FMT_YVYU:
+		for (x = 0; x < w; x++)
+			o[x] = yuv2rgb (s[2 * x], s[4 * (x / 2) + 3], s[4 * (x / 2) + 1]);
+		break;
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV16M:
+		if (f->pixelformat == V4L2_PIX_FMT_NV12M)
+			y /= 2;
+		c = p[1] + y * f->plane_fmt[1].bytesperline;
+		for (x = 0; x < w; x++)
+			o[x] = yuv2rgb (s[x], c[x & ~1], c[x | 1]);
+		break;
+	case V4L2_PIX_FMT_NV21M:
+		c = p[1] + (y / 2) * f->plane_fmt[1].bytesperline;
+		for (x = 0; x < w; x++)
+			o[x] = yuv2rgb (s[x], c[x | 1], c[x & ~1]);
+		break;
+	case V4L2_PIX_FMT_YUV420M:
+	case V4L2_PIX_FMT_YVU420M:
+		x = (f->pixelformat == V4L2_PIX_FMT_YVU420M);
+		u = p[1 + x] + (y / 2) * f->plane_fmt[1 + x].bytesperline;
+		v = p[2 - x] + (y / 2) * f->plane_fmt[2 - x].bytesperline;
+		for (x = 0; x < w; x++)
+			o[x] = yuv2rgb (s[x], u[x / 2], v[x / 2]);
+		break;
+	default:
+		memset (o, 0, w * sizeof(*o));
+		break;
+	}
+}
+
+static void
+sw_pack_row                     (const struct v4l2_pix_format_mplane *f,
+				 uint8_t *const p[], int y, const uint32_t * restrict i)
+{
+	uint8_t *d = p[0] + y * f->plane_fmt[0].bytesperline;
+	uint8_t *c, *u, *v;
+	int x, w = f->width;
+
+	switch (f->pixelformat) {
+	case V4L2_PIX_FMT_RGB565:
+		for (x = 0; x < w; x++) {
+			uint32_t s = ((RGB_R(i[x]) >> 3) << 11) |
+				     ((RGB_G(i[x]) >> 2) << 5) | (RGB_B(i[x]) >> 3);
+
+			d[2 * x] = s;
+			d[2 * x + 1] = s >> 8;
+		}
+		break;
+	case V4L2_PIX_FMT_RGB24:
+		for (x = 0; x < w; x++) {
+			d[3 * x] = RGB_R(i[x]);
+			d[3 * x + 1] = RGB_G(i[x]);
+			d[3 * x + 2] = RGB_B(i[x]);
+		}
+		break;
+	case V4L2_PIX_FMT_BGR24:
+		for (x = 0; x < w; x++) {
+			d[3 * x] = RGB_B(i[x]);
+			d[3 * x + 1] = RGB_G(i[x]);
+			d[3 * x + 2] = RGB_R(i[x]);
+		}
+		break;
+	case V4L2_PIX_FMT_RGB32:
+		for (x = 0; x < w; x++) {
+			d[4 * x] = RGB_B(i[x]);
+			d[4 * x + 1] = RGB_G(i[x]);
+			d[4 * x + 2] = RGB_R(i[x]);
+			d[4 * x + 3] = 0xff;
+		}
+		break;
+	case V4L2_PIX_FMT_UYVY:
+		for (x = 0; x < w; x += 2) {
+			d[2 * x] = RGB_U(i[x]);
+			d[2 * x + 1] = RGB_Y(i[x]);
+			d[2 * x + 2] = RGB_V(i[x]);
+			d[2 * x + 3] = RGB_Y(i[x + 1]);
+		}
+		break;
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+		for (x = 0; x < w; x += 2) {
+			int vu = (f->pixelformat == V4L2_PIX_FMT_YVYU) ? 2 : 0;
+
+			d[2 * x] = RGB_Y(i[x]);
+			d[2 * x + 1 + vu] = RGB_U(i[x]);
+			d[2 * x + 2] = RGB_Y(i[x + 1]);
+			d[2 * x + 3 - vu] = RGB_V(i[x]);
+		}
+		break;
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV16M:
+		for (x = 0; x < w; x++)
+			d[x] = RGB_Y(i[x]);
+		if (f->pixelformat == V4L2_PIX_FMT_NV12M) {
+			if (y & 1)
+				break;
+			y /= 2;
+		}
+		c = p[1] + y * f->plane_fmt[1].bytesperline;
+		for (x = 0; x < w; x += 2) {
+			c[x] = RGB_U(i[x]);
+			c[x + 1] = RGB_V(i[x]);
+		}
+		break;
+	case V4L2_PIX_FMT_NV21M:
+		for (x = 0; x < w; x++)
+			d[x] = RGB_Y(i[x]);
+		if (y & 1)
+			break;
+		c = p[1] + (y / 2) * f->plane_fmt[1].bytesperline;
+		for (x = 0; x < w; x += 2) {
+			c[x] = RGB_V(i[x]);
+			c[x + 1] = RGB_U(i[x]);
+		}
+		break;
+	case V4L2_PIX_FMT_YUV420M:
+	case V4L2_PIX_FMT_YVU420M:
+		for (x = 0; x < w; x++)
+			d[x] = RGB_Y(i[x]);
+		if (y & 1)
+			break;
+		x = (f->pixelformat == V4L2_PIX_FMT_YVU420M);
+		u = p[1 + x] + (y / 2) * f->plane_fmt[1 + x].bytesperline;
+		v = p[2 - x] + (y / 2) * f->plane_fmt[2 - x].bytesperline;
+		for (x = 0; x < w; x += 2) {
+			u[x / 2] = RGB_U(i[x]);
+			v[x / 2] = RGB_V(i[x]);
+		}
+		break;
+	}
+}
+
+/* the 1D LUT of -u: each channel looked up in its byte of the entries */
+static void
+sw_lut_row                      (uint32_t *row, int n, const uint32_t *lut)
+{
+	uint32_t c;
+	int x;
+
+	for (x = 0; x < n; x++) {
+		c = row[x];
+		row[x] = (lut[RGB_R(c)] & 0xff0000) | (lut[RGB_G(c)] & 0xff00) |
+			 (lut[RGB_B(c)] & 0xff);
+	}
+}
+
+/* 'scratch' holds at least in->width + out->width pixels; 'lut' may be NULL */
+static void
+sw_convert                      (const struct v4l2_pix_format_mplane *in, uint8_t *const src[],
+				 const struct v4l2_pix_format_mplane *out, uint8_t *const dst[],
+				 uint32_t *scratch, const uint32_t *lut)
+{
+	uint32_t *row = scratch, *scaled = scratch + in->width;
+	unsigned int x, y, sy, last = 0;
+
+	for (y = 0; y < out->height; y++) {
+		sy = y * in->height / out->height;
+		if (!y || sy != last) {
+			sw_unpack_row (in, src, sy, row);
+			if (in->width == out->width)
+				memcpy (scaled, row, in->width * sizeof(*row));
+			else
+				for (x = 0; x < out->width; x++)
+					scaled[x] = row[x * in->width / out->width];
+			if (lut)
+				sw_lut_row (scaled, out->width, lut);
+			last = sy;
+		}
+		sw_pack_row (out, dst, y, scaled);
+	}
+}
+
+/*
+ * CPU fallback for -t/-H/-V: dst = rotate(flip(src)) for packed
+ * single-plane formats. The destination is walked in tiles so that the
+ * column reads of a 90/270 degree rotation stay in cache; 32bpp
+ * rotations move 4x4 blocks through vector registers.
+ */
+#define ORIENT_TILE 32
+
+typedef uint32_t v4u32 __attribute__ ((vector_size (16)));
+
+static int
+orient_bpp                      (uint32_t fourcc)
+{
+	switch (fourcc) {
+	case V4L2_PIX_FMT_RGB565:
+		return 2;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		return 3;
+	case V4L2_PIX_FMT_RGB32:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static inline void
+copy_pixel                      (uint8_t *d, const uint8_t *s, int bpp)
+{
+	switch (bpp) {
+	case 2:
+		memcpy (d, s, 2);
+		break;
+	case 3:
+		memcpy (d, s, 3);
+		break;
+	default:
+		memcpy (d, s, 4);
+		break;
+	}
+}
+
+static void
+orient_plane                    (const uint8_t *src, int w, int h, int sstride,
+				 uint8_t *dst, int bpp, int rot, int hf, int vf)
+{
+	int dw = (rot % 180) ? h : w, dh = (rot % 180) ? w : h;
+	int dstride = dw * bpp;
+	/* u = u0 + ux * x' + uy * y', v = v0 + vx * x' + vy * y' */
+	int u0 = 0, ux = 1, uy = 0, v0 = 0, vx = 0, vy = 1;
+	int tx, ty, x, y, xe, ye, i;
+
+	switch (rot) {
+	case 90:
+		ux = 0; uy = 1; v0 = h - 1; vx = -1; vy = 0;
+		break;
+	case 180:
+		u0 = w - 1; ux = -1; v0 = h - 1; vy = -1;
+		break;
+	case 270:
+		u0 = w - 1; ux = 0; uy = -1; vx = 1; vy = 0;
+		break;
+	}
+	if (hf) {
+		u0 = w - 1 - u0; ux = -ux; uy = -uy;
+	}
+	if (vf) {
+		v0 = h - 1 - v0; vx = -vx; vy = -vy;
+	}
+
+	for (ty = 0; ty < dh; ty += ORIENT_TILE)
+	for (tx = 0; tx < dw; tx += ORIENT_TILE) {
+		xe = (tx + ORIENT_TILE < dw) ? tx + ORIENT_TILE : dw;
+		ye = (ty + ORIENT_TILE < dh) ? ty + ORIENT_TILE : dh;
+
+		if (bpp == 4 && ux == 0 && !((xe - tx) & 3) && !((ye - ty) & 3)) {
+			/* transposing: 4 source rows become 4 destination columns */
+			for (y = ty; y < ye; y += 4)
+			for (x = tx; x < xe; x += 4) {
+				v4u32 r[4], t[4], c[4];
+
+				for (i = 0; i < 4; i++) {
+					int u = u0 + uy * y, v = v0 + vx * (x + i);
+
+					memcpy (&r[i], src + v * sstride +
+						(uy > 0 ? u : u - 3) * 4, 16);
+					if (uy < 0)
+						r[i] = __builtin_shuffle (r[i], (v4u32){ 3, 2, 1, 0 });
+				}
+				t[0] = __builtin_shuffle (r[0], r[1], (v4u32){ 0, 4, 1, 5 });
+				t[1] = __builtin_shuffle (r[0], r[1], (v4u32){ 2, 6, 3, 7 });
+				t[2] = __builtin_shuffle (r[2], r[3], (v4u32){ 0, 4, 1, 5 });
+				t[3] = __builtin_shuffle (r[2], r[3], (v4u32){ 2, 6, 3, 7 });
+				c[0] = __builtin_shuffle (t[0], t[2], (v4u32){ 0, 1, 4, 5 });
+				c[1] = __builtin_shuffle (t[0], t[2], (v4u32){ 2, 3, 6, 7 });
+				c[2] = __builtin_shuffle (t[1], t[3], (v4u32){ 0, 1, 4, 5 });
+				c[3] = __builtin_shuffle (t[1], t[3], (v4u32){ 2, 3, 6, 7 });
+				for (i = 0; i < 4; i++)
+					memcpy (dst + (y + i) * dstride + x * 4, &c[i], 16);
+			}
+			continue;
+		}
+
+		for (y = ty; y < ye; y++)
+			for (x = tx; x < xe; x++)
+				copy_pixel (dst + y * dstride + x * bpp,
+					    src + (v0 + vx * x + vy * y) * sstride +
+					    (u0 + ux * x + uy * y) * bpp, bpp);
+	}
+}
+
+/* plane layout of the software device, tightly packed */
+static int
+sw_fill_format                  (struct v4l2_pix_format_mplane *f, int w, int h, uint32_t fourcc)
+{
+	CLEAR (*f);
+	f->width = w;
+	f->height = h;
+	f->pixelformat = fourcc;
+	f->field = V4L2_FIELD_NONE;
+	f->num_planes = 1;
+
+	switch (fourcc) {
+	case V4L2_PIX_FMT_RGB565:
+	case V4L2_PIX_FMT_UYVY:
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_YVYU:
+		f->plane_fmt[0].bytesperline = w * 2;
+		break;
+	case V4L2_PIX_FMT_RGB24:
+	case V4L2_PIX_FMT_BGR24:
+		f->plane_fmt[0].bytesperline = w * 3;
+		break;
+	case V4L2_PIX_FMT_RGB32:
+		f->plane_fmt[0].bytesperline = w * 4;
+		break;
+	case V4L2_PIX_FMT_NV12M:
+	case V4L2_PIX_FMT_NV21M:
+	case V4L2_PIX_FMT_NV16M:
+		f->num_planes = 2;
+		f->plane_fmt[0].bytesperline = w;
+		f->plane_fmt[1].bytesperline = w;
+		f->plane_fmt[1].sizeimage = w * h /
+			((fourcc == V4L2_PIX_FMT_NV16M) ? 1 : 2);
+		break;
+	case V4L2_PIX_FMT_YUV420M:
+	case V4L2_PIX_FMT_YVU420M:
+		f->num_planes = 3;
+		f->plane_fmt[0].bytesperline = w;
+		f->plane_fmt[1].bytesperline = w / 2;
+		f->plane_fmt[2].bytesperline = w / 2;
+		f->plane_fmt[1].sizeimage = w * h / 4;
+		f->plane_fmt[2].sizeimage = w * h / 4;
+		break;
+	default:
+		return -1;
+	}
+	f->plane_fmt[0].sizeimage = f->plane_fmt[0].bytesperline * h;
+
+	return 0;
+}
+
+static void
+load_params                     (const char *name)
+{
+	FILE *fp;
+	char line[256];
+	struct frame_param p;
+	int n;
+
+	if ((fp = fopen (name, "r")) == NULL)
+		errno_exit ("cannot open ", name);
+
+	/* <frame> <left> <top> <width> <height> [<alpha>] */
+	while (fgets (line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		CLEAR (p);
+		p.alpha = -1;
+		n = sscanf (line, "%u %d %d %u %u %d", &p.frame,
+			    &p.crop.left, &p.crop.top,
+			    &p.crop.width, &p.crop.height, &p.alpha);
+		if (n < 5) {
+			fprintf (stderr, "%s: malformed line: %s", name, line);
+			exit (EXIT_FAILURE);
+		}
+		if (n_params && p.frame < params[n_params - 1].frame) {
+			fprintf (stderr, "%s: frames must be in ascending order\n", name);
+			exit (EXIT_FAILURE);
+		}
+		params = realloc (params, sizeof(p) * (n_params + 1));
+		params[n_params++] = p;
+	}
+	fclose (fp);
+
+	printf("%d per-frame parameter(s) loaded\n", n_params);
+}
+
+static void
+set_alpha                       (int fd, int req_fd, int alpha)
+{
+	struct v4l2_ext_controls ctrls;
+	struct v4l2_ext_control ctrl;
+
+	CLEAR (ctrls);
+	CLEAR (ctrl);
+	ctrl.id = V4L2_CID_ALPHA_COMPONENT;
+	ctrl.value = alpha;
+	ctrls.count = 1;
+	ctrls.controls = &ctrl;
+#ifdef V4L2_CTRL_WHICH_REQUEST_VAL
+	if (req_fd >= 0) {
+		ctrls.which = V4L2_CTRL_WHICH_REQUEST_VAL;
+		ctrls.request_fd = req_fd;
+	}
+#endif
+
+	if (-1 == xioctl (fd, VIDIOC_S_EXT_CTRLS, &ctrls))
+		fprintf (stderr, "cannot set alpha %d: %d, %s\n",
+			 alpha, errno, strerror (errno));
+}
+
+static void
+set_crop                        (int fd, struct v4l2_rect *r)
+{
+	struct v4l2_subdev_selection sel;
+
+	CLEAR (sel);
+	sel.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+	sel.pad = 0;
+	sel.target = V4L2_SEL_TGT_CROP;
+	sel.r = *r;
+
+	if (-1 == xioctl (fd, VIDIOC_SUBDEV_S_SELECTION, &sel))
+		fprintf (stderr, "cannot crop (%d,%d)/%ux%u: %d, %s\n",
+			 r->left, r->top, r->width, r->height,
+			 errno, strerror (errno));
+}
+
+/*
+ * Take the parameters due for frame 'seq'; returns 1 if the crop window
+ * moved. The alpha rides along with the OUT buffer in its request, or is
+ * set on the RPF for whatever frame runs next, so without requests this
+ * is only called on a drained pipeline (see params_due()). The crop is
+ * only recorded here, setup_pads() gives it to the RPF and sizes the
+ * pads behind it.
+ */
+static int
+apply_frame_params              (unsigned int seq, int req_fd)
+{
+	struct frame_param *p;
+	int alpha = -1, moved = 0;
+
+	while (next_param < n_params && params[next_param].frame <= seq) {
+		p = &params[next_param++];
+		if (p->crop.width && p->crop.height &&
+		    memcmp (&p->crop, &crop, sizeof(crop))) {
+			crop = p->crop;
+			moved = 1;
+		}
+		if (p->alpha >= 0)
+			alpha = p->alpha;
+	}
+
+	if (alpha >= 0)
+		set_alpha ((req_fd >= 0) ? v4lout_fd : v4lsub_fd[OUT],
+			   req_fd, alpha);
+	return moved;
+}
+
+/*
+ * Parameters due for frame out_seq that have to wait for the pipeline to
+ * drain: a crop, which changes the pads, and without requests anything,
+ * since a control set with frames queued lands on whichever runs next.
+ */
+static int
+params_due                      (void)
+{
+	unsigned int i;
+
+	if (out_seq >= frame_count)
+		return 0;
+	for (i = next_param; i < n_params && params[i].frame <= out_seq; i++)
+		if (!use_requests || params[i].crop.width)
+			return 1;
+	return 0;
+}
+
+/*
+ * The vsp1 driver doesn't support requests on its video nodes (no
+ * V4L2_BUF_CAP_SUPPORTS_REQUESTS), so there -r falls back to draining
+ * the pipeline for every change; drivers that do take the alpha with
+ * the buffer.
+ */
+static void
+init_requests                   (void)
+{
+	unsigned int i;
+
+#if defined(MEDIA_IOC_REQUEST_ALLOC) && defined(V4L2_BUF_CAP_SUPPORTS_REQUESTS)
+	if (!(buf_caps[OUT] & V4L2_BUF_CAP_SUPPORTS_REQUESTS)) {
+		printf("%s does not support requests, "
+		       "setting parameters between frames.\n", dev_name[OUT]);
+		use_requests = 0;
+		return;
+	}
+
+	for (i = 0; i < n_buffers[OUT]; i++) {
+		if (-1 == xioctl (media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd[i]))
+			errno_exit ("MEDIA_IOC_REQUEST_ALLOC for ", ocstring[OUT]);
+		printf("request[%u] = %d\n", i, request_fd[i]);
+	}
+#else
+	printf("built without the request API, "
+	       "setting parameters between frames.\n");
+	use_requests = 0;
+#endif
+}
+
+static void
+reset_requests                  (void)
+{
+#ifdef MEDIA_REQUEST_IOC_REINIT
+	int i;
+
+	/* requests of buffers returned by STREAMOFF are never dequeued */
+	for (i = 0; i < N_BUFFERS; i++)
+		if (request_fd[i] >= 0)
+			xioctl (request_fd[i], MEDIA_REQUEST_IOC_REINIT, NULL);
+#endif
+}
+
+static void
+uninit_requests                 (void)
+{
+	int i;
+
+	for (i = 0; i < N_BUFFERS; i++) {
+		if (request_fd[i] >= 0)
+			close (request_fd[i]);
+		request_fd[i] = -1;
+	}
+}
+
+static void
+log_latency                     (double lat)
+{
+	if (lat_n < lat_max)
+		lat_log[lat_n++] = lat;
+}
+
+/* a timed sleep that was due at 'due' (monotonic) returned now */
+static void
+log_wakeup                      (double due)
+{
+	double late = monotonic_sec () - due;
+	unsigned int b;
+
+	if (late < 0.0)
+		late = 0.0;
+	b = late * 1e5;
+	wake_hist[(b < WAKE_BUCKETS) ? b : WAKE_BUCKETS - 1]++;
+	wake_sum += late;
+	if (late > wake_max)
+		wake_max = late;
+	wake_n++;
+}
+
+static double
+live_arrival                    (unsigned int n)
+{
+	return live_t0.tv_sec + live_t0.tv_nsec * 1e-9 + n / live_fps;
+}
+
+/*
+ * Wait for input frame live_in to "arrive" as a camera at live_fps
+ * would deliver it. If we are already behind, a frame that cannot be
+ * emitted before its deadline is dropped as long as a newer one is
+ * waiting, so queueing never lets the latency grow unbounded.
+ */
+static void
+live_pace                       (uint8_t *const p[], const struct v4l2_pix_format_mplane *f)
+{
+	struct timespec ts;
+	double now, t;
+	unsigned int i;
+
+	if (live_in >= frame_count)
+		return;
+	if (!live_in)
+		clock_gettime (CLOCK_MONOTONIC, &live_t0);
+
+	t = live_arrival (live_in);
+	ts.tv_sec = (time_t)t;
+	ts.tv_nsec = (long)((t - ts.tv_sec) * 1e9);
+	while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+	if (rt_report)
+		log_wakeup (t);
+
+	now = monotonic_sec ();
+	while (live_in + 1 < frame_count &&
+	       live_arrival (live_in + 1) <= now &&
+	       now + live_svc > live_arrival (live_in) + latency_budget) {
+		TRACE (drop, OUT, live_in, -1);
+		if (input_fd >= 0 && repack_fmt)
+			in_stream.offset += input_frame_size (f);
+		else if (input_fd >= 0)
+			for (i = 0; i < f->num_planes; i++)
+				stream_read (&in_stream, p[i], f->plane_fmt[i].sizeimage);
+		live_drops++;
+		live_in++;
+		METRIC_ADD (frames_dropped, 1);
+		fputc ('d', stdout);
+		fflush (stdout);
+	}
+
+	i = out_seq % VIDEO_MAX_FRAME;
+	live_frame[i].arrival = live_arrival (live_in);
+	live_frame[i].due = live_frame[i].arrival + latency_budget;
+	live_in++;
+}
+
+static void
+live_emitted                    (void)
+{
+	unsigned int i = emit_seq % VIDEO_MAX_FRAME;
+	double now = monotonic_sec (), lat = now - live_frame[i].arrival;
+
+	if (now > live_frame[i].due)
+		live_misses++;
+	live_lat_sum += lat;
+	if (lat > live_lat_max)
+		live_lat_max = lat;
+	lat = now - live_frame[i].queued;
+	live_svc = live_svc ? live_svc + (lat - live_svc) / 8 : lat;
+}
+
+static void
+report_live                     (void)
+{
+	unsigned int n = live_in - live_drops;
+
+	printf("live %.2f fps: %u frames in, %u dropped, %u of %u past the "
+	       "%.1f ms deadline, latency avg %.3f max %.3f ms\n",
+	       live_fps, live_in, live_drops, live_misses, n, latency_budget * 1e3,
+	       n ? live_lat_sum / n * 1e3 : 0.0, live_lat_max * 1e3);
+}
+
+static void
+frame_emitted                   (void)
+{
+	double now = gettimeofday_sec (), ival = now - t_last;
+
+	if (live_fps > 0.0)
+		live_emitted ();
+
+	if (emit_seq >= WARMUP_FRAMES) {
+		if (!ival_n || ival < ival_min)
+			ival_min = ival;
+		if (ival > ival_max)
+			ival_max = ival;
+		ival_sum += ival;
+		ival_sum2 += ival * ival;
+		ival_n++;
+		if (ival > latency_budget)
+			ival_late++;
+	}
+
+	t_last = now;
+	if (!emit_seq)
+		t_first = now;
+	if (++emit_seq == WARMUP_FRAMES)
+		t_steady = t_last;
+	if (metrics) {
+		METRIC_ADD (frames_written, 1);
+		METRIC_SET (update_ns, monotonic_ns ());
+	}
+}
+
+/*
+ * Frames are numbered in input order. The hardware returns them in the
+ * order they were queued, CPU jobs may finish in any order; everything
+ * is written out strictly by sequence number.
+ */
+struct pending_frame {
+	unsigned int seq;
+	uint8_t *data;		/* NULL: 'count' repeats of the last output */
+	unsigned int count;
+	struct pending_frame *next;
+};
+
+static struct pending_frame *	pending		= NULL;
+static unsigned int		n_pending	= 0;
+static unsigned int		max_pending	= 0;
+
+static struct {
+	unsigned int seq;
+	double t;
+} hw_fifo[VIDEO_MAX_FRAME];
+static unsigned int		hw_head		= 0;
+static unsigned int		hw_tail		= 0;
+static unsigned int		hw_inflight	= 0;
+static unsigned int		hw_frames	= 0;
+static double			hw_lat_sum	= 0.0;
+static double			hw_svc		= 0.0;	/* time per frame, EWMA */
+static double			last_cap_time	= 0.0;
+
+enum {
+	JOB_FREE,
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+};
+
+struct cpu_job {
+	int state;
+	unsigned int seq;
+	double t_submit;
+	double t_done;
+	struct v4l2_pix_format_mplane in;
+	struct v4l2_pix_format_mplane out;
+	uint8_t *src[VIDEO_MAX_PLANES];
+	uint8_t *dst[VIDEO_MAX_PLANES];
+	size_t src_len;
+	size_t dst_len;
+	uint32_t *scratch;
+	size_t scratch_len;
+	uint32_t lut[LUT_SIZE];		/* lut_table[lut_front] when queued */
+};
+
+static struct cpu_job		cpu_jobs[MAX_CPU_WORKERS];
+static pthread_t		cpu_threads[MAX_CPU_WORKERS];
+static pthread_mutex_t		cpu_lock	= PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		cpu_cond	= PTHREAD_COND_INITIALIZER;
+static int			cpu_pipe[2]	= { -1, -1 };
+static int			cpu_quit	= 0;
+static unsigned int		cpu_inflight	= 0;
+static unsigned int		cpu_frames	= 0;
+static double			cpu_lat_sum	= 0.0;
+static double			cpu_lat		= 0.0;	/* EWMA */
+
+static int
+switch_due                      (void)
+{
+	return cur_switch < n_switches && switches[cur_switch].frame <= out_seq;
+}
+
+/*
+ * Regression input: a triangle wave over row + byte offset, moving with
+ * the frame number. Smooth, so scaled output stays comparable with the
+ * nearest-neighbour software reference.
+ */
+static void
+fill_pattern                    (uint8_t *const p[], const struct v4l2_pix_format_mplane *f,
+				 unsigned int seq)
+{
+	unsigned int i, r, c, rows, bpl, v;
+
+	for (i = 0; i < f->num_planes; i++) {
+		bpl = f->plane_fmt[i].bytesperline;
+		rows = bpl ? f->plane_fmt[i].sizeimage / bpl : 0;
+		for (r = 0; r < rows; r++)
+			for (c = 0; c < bpl; c++) {
+				v = (c + r + 4 * seq + 64 * i) & 0x1ff;
+				p[i][r * bpl + c] = (v > 255) ? 511 - v : v;
+			}
+	}
+}
+
+static size_t
+frame_size                      (const struct v4l2_pix_format_mplane *f, uint8_t *base, uint8_t *p[])
+{
+	unsigned int i;
+	size_t len = 0;
+
+	for (i = 0; i < f->num_planes; i++) {
+		if (p)
+			p[i] = base + len;
+		len += f->plane_fmt[i].sizeimage;
+	}
+
+	return len;
+}
+
+/* frame number in the files of this shard's frame 'seq' */
+static off_t
+shard_frame                     (unsigned int seq)
+{
+	return shard_rr ? (off_t)seq * shard_total + shard_id : (off_t)shard_first + seq;
+}
+
+/* returns 1 when --dedup is on and the frame equals the previous one */
+static int
+read_input                      (uint8_t *const p[], const struct v4l2_pix_format_mplane *f)
+{
+	unsigned int i;
+	uint64_t h = 0, t = 0;
+	int dup = 0;
+
+	if (live_fps > 0.0)
+		live_pace (p, f);
+
+	if (input_fd >= 0) {
+		if (n_shards)
+			in_stream.offset = shard_frame (out_seq) * input_frame_size (f);
+		input_off[out_seq % VIDEO_MAX_FRAME] = stream_tell (&in_stream);
+		TRACE (read_begin, OUT, -1, out_seq);
+		t = metrics ? monotonic_ns () : 0;
+		if (repack_fmt)
+			repack_frame (&in_stream, p, f);
+		for (i = 0; i < f->num_planes; i++) {
+			if (!repack_fmt)
+				stream_read (&in_stream, p[i], f->plane_fmt[i].sizeimage);
+			if (dedup)
+				h = hash_bytes (p[i], f->plane_fmt[i].sizeimage, h);
+		}
+		TRACE (read_end, OUT, -1, out_seq);
+		if (metrics) {
+			METRIC_ADD (read_ns, monotonic_ns () - t);
+			METRIC_ADD (bytes_read, input_frame_size (f));
+		}
+
+		/* frame parameters changing here make it a new frame */
+		for (i = next_param; have_hash && i < n_params && params[i].frame <= out_seq; i++)
+			if (params[i].frame == out_seq)
+				have_hash = 0;
+		if (dedup) {
+			dup = have_hash && h == last_hash;
+			last_hash = h;
+			have_hash = 1;
+		}
+	} else if (regress) {
+		fill_pattern (p, f, out_seq);
+	}
+
+	if (live_fps > 0.0)
+		live_frame[out_seq % VIDEO_MAX_FRAME].queued = monotonic_sec ();
+	METRIC_ADD (frames_read, 1);
+
+	return dup;
+}
+
+static void
+buffer_planes                   (int index, int i, uint8_t *p[])
+{
+	unsigned int j;
+
+	for (j = 0; j < n_planes[index]; j++)
+		p[j] = buffers[index][i][j].start;
+}
+
+/*
+ * Repeats are copied within the output file, but O_DIRECT output may
+ * still be staged and a pipe can't be read back, so those keep a copy
+ * of the last frame.
+ */
+static int
+keep_copy                       (void)
+{
+	return dedup && output_fd >= 0 && (out_stream.direct || !out_stream.seekable);
+}
+
+/* a copy of what was written last */
+static void
+keep_output                     (uint8_t **p, const size_t *len, unsigned int n)
+{
+	unsigned int i;
+	size_t total = 0;
+
+	for (i = 0; i < n; i++)
+		total += len[i];
+	if (total > last_out_size) {
+		free (last_out);
+		last_out = malloc (last_out_size = total);
+		if (!last_out)
+			errno_exit ("cannot allocate the repeat buffer", NULL);
+	}
+	for (i = 0, last_out_len = 0; i < n; i++) {
+		memcpy (last_out + last_out_len, p[i], len[i]);
+		last_out_len += len[i];
+	}
+}
+
+static int
+orient_requested                (void)
+{
+	return rotation || hflip || vflip;
+}
+
+/* 'orient': the frame still needs the CPU rotation/flip */
+static void
+write_frame                     (uint8_t *const p[], const struct v4l2_pix_format_mplane *f, int orient)
+{
+	unsigned int i;
+	int bpp = orient_bpp (f->pixelformat);
+	size_t len = (size_t)f->width * f->height * bpp;
+	uint64_t t = metrics ? monotonic_ns () : 0;
+
+	TRACE (write_begin, CAP, -1, emit_seq);
+	if (n_shards)
+		out_stream.offset = shard_frame (emit_seq) *
+			((orient && orient_requested ()) ? len : frame_size (f, NULL, NULL));
+	if (delta && output_fd >= 0)
+		delta_begin ((orient && orient_requested ()) ? len : frame_size (f, NULL, NULL));
+	n_plane_hash = 0;
+	last_out_off = out_stream.offset;
+	last_out_len = (orient && orient_requested ()) ? len : frame_size (f, NULL, NULL);
+	if (orient && orient_requested ()) {
+		if (len > orient_len) {
+			free (orient_buf);
+			orient_buf = malloc (orient_len = len);
+			if (!orient_buf)
+				errno_exit ("cannot allocate a rotation buffer", NULL);
+		}
+		orient_plane (p[0], f->width, f->height, f->plane_fmt[0].bytesperline,
+			      orient_buf, bpp, rotation, hflip, vflip);
+		process_image (orient_buf, len);
+		if (keep_copy ())
+			keep_output (&orient_buf, &len, 1);
+	} else {
+		for (i = 0; i < f->num_planes; i++)
+			process_image (p[i], f->plane_fmt[i].sizeimage);
+		if (keep_copy ()) {
+			size_t sizes[VIDEO_MAX_PLANES];
+
+			for (i = 0; i < f->num_planes; i++)
+				sizes[i] = f->plane_fmt[i].sizeimage;
+			keep_output ((uint8_t **)p, sizes, f->num_planes);
+		}
+	}
+	if (delta && output_fd >= 0)
+		delta_end ();
+	if (metrics)
+		METRIC_ADD (write_ns, monotonic_ns () - t);
+	TRACE (write_end, CAP, -1, emit_seq);
+}
+
+/* write the last output again for a duplicate input frame */
+static void
+repeat_output                   (void)
+{
+	uint64_t t = metrics ? monotonic_ns () : 0;
+	unsigned int i;
+
+	TRACE (write_begin, CAP, -1, emit_seq);
+	if (n_shards)
+		out_stream.offset = shard_frame (emit_seq) * last_out_len;
+	printf("O %zu bytes\n", last_out_len);
+        fflush (stdout);
+	for (i = 0; regress && i < n_plane_hash; i++)
+		out_hash = fold_hash (out_hash, last_plane_hash[i]);
+	METRIC_ADD (bytes_written, last_out_len);
+	if (output_fd >= 0) {
+		if (delta)
+			delta_repeat ();
+		else if (keep_copy ())
+			stream_write (&out_stream, last_out, last_out_len);
+		else
+			stream_repeat (&out_stream, last_out_off, last_out_len);
+	}
+	if (metrics)
+		METRIC_ADD (write_ns, monotonic_ns () - t);
+	TRACE (write_end, CAP, -1, emit_seq);
+	n_dups++;
+	METRIC_ADD (frames_dup, 1);
+}
+
+static void
+flush_frames                    (void)
+{
+	struct pending_frame **pp, *pf;
+	uint8_t *p[VIDEO_MAX_PLANES];
+	unsigned int i;
+	int found;
+
+	do {
+		found = 0;
+		for (pp = &pending; *pp; pp = &(*pp)->next) {
+			if ((*pp)->seq != emit_seq)
+				continue;
+			pf = *pp;
+			found = 1;
+			if (!pf->data) {
+				repeat_output ();
+				if (--pf->count) {
+					pf->seq++;
+					break;
+				}
+			} else {
+				p[0] = pf->data;
+				for (i = 1; i < pix_fmt[CAP].num_planes; i++)
+					p[i] = p[i - 1] + pix_fmt[CAP].plane_fmt[i - 1].sizeimage;
+				write_frame (p, &pix_fmt[CAP], !hw_orient);
+			}
+			*pp = pf->next;
+			free (pf->data);
+			free (pf);
+			n_pending--;
+			break;
+		}
+
+		for (i = 0; !found && i < n_workers; i++) {
+			struct cpu_job *job = &cpu_jobs[i];
+			int done;
+
+			pthread_mutex_lock (&cpu_lock);
+			done = (job->state == JOB_DONE);
+			pthread_mutex_unlock (&cpu_lock);
+			if (!done || job->seq != emit_seq)
+				continue;
+
+			write_frame (job->dst, &job->out, 1);
+			cpu_frames++;
+			cpu_lat_sum += job->t_done - job->t_submit;
+			METRIC_ADD (frames_cpu, 1);
+			METRIC_ADD (convert_ns, (job->t_done - job->t_submit) * 1e9);
+			log_latency (job->t_done - job->t_submit);
+			cpu_lat = cpu_lat ? cpu_lat + (job->t_done - job->t_submit - cpu_lat) / 8
+					  : job->t_done - job->t_submit;
+			job->state = JOB_FREE;
+			cpu_inflight--;
+			METRIC_SET (cpu_inflight, cpu_inflight);
+			found = 1;
+		}
+
+		if (found)
+			frame_emitted ();
+	} while (found);
+	METRIC_SET (pending, n_pending);
+}
+
+/* frame 'seq' is a duplicate: no conversion, the previous output again */
+static void
+repeat_frame                    (unsigned int seq)
+{
+	struct pending_frame *pf;
+
+	for (pf = pending; pf; pf = pf->next)
+		if (!pf->data && pf->seq + pf->count == seq) {
+			pf->count++;
+			break;
+		}
+	if (!pf) {
+		pf = calloc (1, sizeof(*pf));
+		if (!pf)
+			errno_exit ("cannot park frame", NULL);
+		pf->seq = seq;
+		pf->count = 1;
+		pf->next = pending;
+		pending = pf;
+		if (++n_pending > max_pending)
+			max_pending = n_pending;
+	}
+	fputc ('=', stdout);
+	fflush (stdout);
+	flush_frames ();
+}
+
+/* a hardware frame is done; write it now or park a copy until its turn */
+static void
+emit_hw_frame                   (int i)
+{
+	struct pending_frame *pf;
+	uint8_t *p[VIDEO_MAX_PLANES];
+	unsigned int j, seq;
+	size_t len = 0;
+	double now = gettimeofday_sec ();
+
+	assert (hw_inflight > 0);
+	seq = hw_fifo[hw_tail % VIDEO_MAX_FRAME].seq;
+	hw_lat_sum += now - hw_fifo[hw_tail % VIDEO_MAX_FRAME].t;
+	log_latency (now - hw_fifo[hw_tail % VIDEO_MAX_FRAME].t);
+	if (last_cap_time > 0.0) {
+		double start = hw_fifo[hw_tail % VIDEO_MAX_FRAME].t;
+
+		if (last_cap_time > start)
+			start = last_cap_time;
+		hw_svc = hw_svc ? hw_svc + (now - start - hw_svc) / 8 : now - start;
+	}
+	last_cap_time = now;
+	hw_tail++;
+	hw_inflight--;
+	hw_frames++;
+	METRIC_ADD (frames_hw, 1);
+	METRIC_ADD (convert_ns, (now - hw_fifo[(hw_tail - 1) % VIDEO_MAX_FRAME].t) * 1e9);
+	METRIC_SET (hw_inflight, hw_inflight);
+
+	buffer_planes (CAP, i, p);
+	recover_streak = 0;
+	if (seq == emit_seq) {
+		write_frame (p, &pix_fmt[CAP], !hw_orient);
+		frame_emitted ();
+		flush_frames ();
+		return;
+	}
+
+	for (j = 0; j < pix_fmt[CAP].num_planes; j++)
+		len += pix_fmt[CAP].plane_fmt[j].sizeimage;
+	pf = malloc (sizeof(*pf));
+	if (pf)
+		pf->data = malloc (len);
+	if (!pf || !pf->data)
+		errno_exit ("cannot park frame", NULL);
+	pf->seq = seq;
+	for (j = 0, len = 0; j < pix_fmt[CAP].num_planes; j++) {
+		memcpy (pf->data + len, p[j], pix_fmt[CAP].plane_fmt[j].sizeimage);
+		len += pix_fmt[CAP].plane_fmt[j].sizeimage;
+	}
+	pf->next = pending;
+	pending = pf;
+	if (++n_pending > max_pending)
+		max_pending = n_pending;
+	METRIC_SET (pending, n_pending);
+}
+
+static void
+hw_submitted                    (unsigned int seq)
+{
+	hw_fifo[hw_head % VIDEO_MAX_FRAME].seq = seq;
+	hw_fifo[hw_head % VIDEO_MAX_FRAME].t = gettimeofday_sec ();
+	hw_head++;
+	hw_inflight++;
+	METRIC_SET (hw_inflight, hw_inflight);
+	if (histo_fd >= 0)
+		histo_fifo[histo_head++ % VIDEO_MAX_FRAME] = seq;
+}
+
+static void
+prefault_stack                  (void)
+{
+	volatile char stack[PREFAULT_STACK];
+
+	memset ((char *)stack, 0, sizeof(stack));
+}
+
+static void *
+cpu_worker                      (void *arg)
+{
+	struct cpu_job *job;
+	unsigned int i;
+
+	(void)arg;
+	if (lock_memory)
+		prefault_stack ();
+
+	pthread_mutex_lock (&cpu_lock);
+	for (;;) {
+		job = NULL;
+		while (!cpu_quit) {
+			for (i = 0; i < n_workers; i++)
+				if (cpu_jobs[i].state == JOB_QUEUED &&
+				    (!job || cpu_jobs[i].seq < job->seq))
+					job = &cpu_jobs[i];
+			if (job)
+				break;
+			pthread_cond_wait (&cpu_cond, &cpu_lock);
+		}
+		if (cpu_quit)
+			break;
+
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock (&cpu_lock);
+
+		sw_convert (&job->in, job->src, &job->out, job->dst, job->scratch,
+			    lut_entries ? job->lut : NULL);
+
+		pthread_mutex_lock (&cpu_lock);
+		job->t_done = gettimeofday_sec ();
+		job->state = JOB_DONE;
+		if (write (cpu_pipe[1], "", 1) < 0 && errno != EAGAIN)
+			perror ("cpu_pipe");
+	}
+	pthread_mutex_unlock (&cpu_lock);
+
+	return NULL;
+}
+
+/*
+ * Offload the next frame when queueing it to the hardware would exceed
+ * the latency budget and a CPU worker is expected to do better.
+ */
+static int
+cpu_should_take                 (void)
+{
+	double hw_pred;
+
+	if (!n_workers || cpu_inflight >= n_workers || out_seq >= frame_count ||
+	    switch_due () || params_due ())
+		return 0;
+
+	hw_pred = (hw_inflight + 1) * hw_svc;
+
+	return hw_pred > latency_budget && cpu_lat < hw_pred;
+}
+
+static void
+submit_cpu_frame                (void)
+{
+	struct cpu_job *job = NULL;
+	unsigned int i;
+	size_t len;
+
+	for (i = 0; i < n_workers; i++)
+		if (cpu_jobs[i].state == JOB_FREE) {
+			job = &cpu_jobs[i];
+			break;
+		}
+	assert (job);
+
+	job->in = pix_fmt[OUT];
+	job->out = pix_fmt[CAP];
+	if (orient_requested ())	/* rotated by write_frame() */
+		sw_fill_format (&job->out, width[CAP], height[CAP], format[CAP]);
+
+	len = frame_size (&job->in, NULL, NULL);
+	if (len > job->src_len) {
+		free (job->src[0]);
+		job->src[0] = malloc (job->src_len = len);
+	}
+	len = frame_size (&job->out, NULL, NULL);
+	if (len > job->dst_len) {
+		free (job->dst[0]);
+		job->dst[0] = malloc (job->dst_len = len);
+	}
+	len = (job->in.width + job->out.width) * sizeof(uint32_t);
+	if (len > job->scratch_len) {
+		free (job->scratch);
+		job->scratch = malloc (job->scratch_len = len);
+	}
+	if (!job->src[0] || !job->dst[0] || !job->scratch)
+		errno_exit ("cannot allocate a CPU job", NULL);
+	frame_size (&job->in, job->src[0], job->src);
+	frame_size (&job->out, job->dst[0], job->dst);
+
+	if (read_input (job->src, &job->in)) {
+		repeat_frame (out_seq++);
+		return;
+	}
+	job->seq = out_seq++;
+	job->t_submit = gettimeofday_sec ();
+	if (lut_entries)
+		memcpy (job->lut, lut_table[lut_front], sizeof(job->lut));
+	cpu_inflight++;
+	METRIC_SET (cpu_inflight, cpu_inflight);
+
+	pthread_mutex_lock (&cpu_lock);
+	job->state = JOB_QUEUED;
+	pthread_cond_signal (&cpu_cond);
+	pthread_mutex_unlock (&cpu_lock);
+
+	fputc ('c', stdout);
+	fflush (stdout);
+}
+
+static void
+offload_frames                  (void)
+{
+	while (cpu_should_take ())
+		submit_cpu_frame ();
+}
+
+static void
+collect_cpu_frames              (void)
+{
+	char tmp[64];
+
+	while (read (cpu_pipe[0], tmp, sizeof(tmp)) > 0)
+		;
+	flush_frames ();
+	offload_frames ();
+}
+
+static void
+init_cpu_path                   (void)
+{
+	unsigned int i;
+
+	if (-1 == pipe (cpu_pipe))
+		errno_exit ("pipe for CPU workers", NULL);
+	fcntl (cpu_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl (cpu_pipe[1], F_SETFL, O_NONBLOCK);
+
+	for (i = 0; i < n_workers; i++) {
+		if (pthread_create (&cpu_threads[i], NULL, cpu_worker, NULL))
+			errno_exit ("pthread_create for CPU workers", NULL);
+		if (worker_pinned &&
+		    pthread_setaffinity_np (cpu_threads[i], sizeof(worker_cpus), &worker_cpus))
+			fprintf (stderr, "cannot pin CPU worker %u\n", i);
+	}
+
+	printf("%u CPU worker(s), latency budget %.1f ms\n",
+	       n_workers, latency_budget * 1e3);
+}
+
+static void
+uninit_cpu_path                 (void)
+{
+	struct pending_frame *pf;
+	unsigned int i;
+
+	pthread_mutex_lock (&cpu_lock);
+	cpu_quit = 1;
+	pthread_cond_broadcast (&cpu_cond);
+	pthread_mutex_unlock (&cpu_lock);
+
+	for (i = 0; i < n_workers; i++) {
+		pthread_join (cpu_threads[i], NULL);
+		free (cpu_jobs[i].src[0]);
+		free (cpu_jobs[i].dst[0]);
+		free (cpu_jobs[i].scratch);
+	}
+	while ((pf = pending)) {
+		pending = pf->next;
+		free (pf->data);
+		free (pf);
+	}
+	close (cpu_pipe[0]);
+	close (cpu_pipe[1]);
+
+	printf("frames: %u by VSP (avg %.3f ms), %u by CPU (avg %.3f ms), "
+	       "reorder depth %u\n",
+	       hw_frames, hw_frames ? hw_lat_sum / hw_frames * 1e3 : 0.0,
+	       cpu_frames, cpu_frames ? cpu_lat_sum / cpu_frames * 1e3 : 0.0,
+	       max_pending);
+}
+
+/*
+ * Queue an OUT buffer as frame 'seq', or a CAP buffer. A failure hands
+ * over to recover(), or is returned while recover() itself is running.
+ */
+/*
+ * IO_METHOD_DMABUF: the buffers of both queues come from one pool of
+ * dma-heap buffers in size classes (a power of two and quarter steps
+ * above it), kept across format switches and recoveries so contiguous
+ * memory is allocated once. With a budget, idle buffers of other
+ * classes are given back before anything new is allocated, and queues
+ * are only made as deep as the budget allows.
+ */
+#define POOL_MAX	64
+#define POOL_MIN	(64 * 1024)
+
+struct pool_buf {
+	int fd;
+	void *map;
+	size_t size;		/* size class */
+	size_t want;		/* what the current user asked for */
+	int used;
+};
+
+static struct pool_buf		pool[POOL_MAX];
+static pthread_mutex_t		pool_lock	= PTHREAD_MUTEX_INITIALIZER;
+static size_t			pool_budget	= 0;	/* 0: unlimited */
+static size_t			pool_bytes	= 0;
+static size_t			pool_peak	= 0;
+static unsigned int		pool_allocs	= 0;
+static unsigned int		pool_reuses	= 0;
+static int			heap_fd		= -1;
+
+static const char *		heap_names[]	= {
+	"/dev/dma_heap/linux,cma", "/dev/dma_heap/reserved", "/dev/dma_heap/system",
+};
+
+static size_t
+pool_class                      (size_t len)
+{
+	size_t c = POOL_MIN;
+
+	while (c < len)
+		c <<= 1;
+	if (c > POOL_MIN) {
+		/* c/2 < len <= c: round up to a quarter of c/2 */
+		size_t q = c / 8;
+
+		c = (len + q - 1) / q * q;
+	}
+	return c;
+}
+
+static void
+pool_free                       (struct pool_buf *pb)
+{
+	munmap (pb->map, pb->size);
+	close (pb->fd);
+	pool_bytes -= pb->size;
+	METRIC_SET (pool_bytes, pool_bytes);
+	pb->fd = -1;
+	pb->size = 0;
+}
+
+static struct pool_buf *
+pool_get                        (size_t len)
+{
+	struct dma_heap_allocation_data data;
+	struct pool_buf *pb = NULL;
+	size_t size = pool_class (len), idle = 0;
+	unsigned int i, slot = POOL_MAX;
+
+	pthread_mutex_lock (&pool_lock);
+	for (i = 0; i < POOL_MAX; i++)
+		if (pool[i].size == size && !pool[i].used) {
+			pb = &pool[i];
+			pool_reuses++;
+			goto out;
+		}
+
+	/* evict nothing unless evicting makes room for both a slot and the budget */
+	for (i = 0; i < POOL_MAX; i++)
+		if (!pool[i].size && slot == POOL_MAX)
+			slot = i;
+		else if (pool[i].size && !pool[i].used)
+			idle += pool[i].size;
+	if ((pool_budget && pool_bytes - idle + size > pool_budget) ||
+	    (slot == POOL_MAX && !idle))
+		goto out;
+
+	/* then free idle buffers of other classes until it fits */
+	for (i = 0; i < POOL_MAX &&
+		    ((pool_budget && pool_bytes + size > pool_budget) || slot == POOL_MAX); i++)
+		if (pool[i].size && !pool[i].used) {
+			pool_free (&pool[i]);
+			if (slot == POOL_MAX)
+				slot = i;
+		}
+	i = slot;
+
+	CLEAR (data);
+	data.len = size;
+	data.fd_flags = O_RDWR | O_CLOEXEC;
+	if (-1 == xioctl (heap_fd, DMA_HEAP_IOCTL_ALLOC, &data))
+		goto out;
+	pool[i].map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, data.fd, 0);
+	if (MAP_FAILED == pool[i].map) {
+		close (data.fd);
+		goto out;
+	}
+	pb = &pool[i];
+	pb->fd = data.fd;
+	pb->size = size;
+	pool_bytes += size;
+	if (pool_bytes > pool_peak)
+		pool_peak = pool_bytes;
+	METRIC_SET (pool_bytes, pool_bytes);
+	pool_allocs++;
+out:
+	if (pb) {
+		pb->used = 1;
+		pb->want = len;
+	}
+	pthread_mutex_unlock (&pool_lock);
+
+	return pb;
+}
+
+static void
+pool_put                        (struct pool_buf *pb)
+{
+	pthread_mutex_lock (&pool_lock);
+	pb->used = 0;
+	pthread_mutex_unlock (&pool_lock);
+}
+
+static void
+open_heap                       (void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(heap_names) / sizeof(heap_names[0]) && heap_fd < 0; i++)
+		if ((heap_fd = open (heap_names[i], O_RDWR | O_CLOEXEC)) >= 0)
+			printf("buffer pool from %s\n", heap_names[i]);
+	if (heap_fd < 0)
+		errno_exit ("no dma-heap for the buffer pool", NULL);
+}
+
+static enum v4l2_memory
+buf_memory                      (void)
+{
+	return (io == IO_METHOD_DMABUF) ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP;
+}
+
+/* bracket CPU access to a pool buffer for the cache maintenance */
+static void
+cpu_access                      (int index, int i, int start, int write)
+{
+	struct dma_buf_sync sync;
+	unsigned int j;
+
+	if (io != IO_METHOD_DMABUF)
+		return;
+
+	sync.flags = (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) |
+		     (write ? DMA_BUF_SYNC_WRITE : DMA_BUF_SYNC_READ);
+	for (j = 0; j < n_planes[index]; j++)
+		xioctl (buffers[index][i][j].pb->fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+/*
+ * Size the queues first..last from the pool: one buffer per queue per
+ * round, so with a budget every queue gets a buffer before any gets a
+ * second one.
+ */
+static void
+init_dmabuf_queues              (int first, int last)
+{
+	static const enum v4l2_buf_type type[2] = {
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+	};
+	struct v4l2_requestbuffers req;
+	struct pool_buf *pb;
+	int index, fd, full[2] = { 0, 0 };
+	unsigned int i, j;
+
+	if (heap_fd < 0)
+		open_heap ();
+
+	for (index = first; index <= last; index++)
+		n_buffers[index] = 0;
+
+	for (i = 0; i < N_BUFFERS; i++)
+		for (index = first; index <= last; index++) {
+			if (full[index])
+				continue;
+			n_planes[index] = pix_fmt[index].num_planes;
+			for (j = 0; j < n_planes[index]; j++) {
+				pb = pool_get (pix_fmt[index].plane_fmt[j].sizeimage);
+				if (!pb)
+					break;
+				buffers[index][i][j].pb = pb;
+				buffers[index][i][j].start = pb->map;
+				buffers[index][i][j].length = pb->size;
+			}
+			if (j < n_planes[index]) {
+				while (j--)
+					pool_put (buffers[index][i][j].pb);
+				full[index] = 1;
+				continue;
+			}
+			n_buffers[index]++;
+		}
+
+	for (index = first; index <= last; index++) {
+		fd = (index == OUT) ? v4lout_fd : v4lcap_fd;
+		if (!n_buffers[index]) {
+			fprintf (stderr, "a %s buffer doesn't fit in the %zu KiB pool budget\n",
+				 ocstring[index], pool_budget >> 10);
+			exit (EXIT_FAILURE);
+		}
+
+		CLEAR (req);
+		req.count = n_buffers[index];
+		req.type = type[index];
+		req.memory = V4L2_MEMORY_DMABUF;
+		if (-1 == xioctl (fd, VIDIOC_REQBUFS, &req))
+			errno_exit ("VIDIOC_REQBUFS for ", dev_name[index]);
+#ifdef V4L2_BUF_CAP_SUPPORTS_REQUESTS
+		buf_caps[index] = req.capabilities;
+#endif
+		if (req.count < n_buffers[index]) {
+			for (i = req.count; i < n_buffers[index]; i++)
+				for (j = 0; j < n_planes[index]; j++)
+					pool_put (buffers[index][i][j].pb);
+			n_buffers[index] = req.count;
+		}
+		printf("%s: %u pool buffer(s)%s\n", ocstring[index], n_buffers[index],
+		       full[index] ? ", limited by the budget" : "");
+	}
+}
+
+static void
+uninit_dmabuf_queue             (int index)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < n_buffers[index]; i++)
+		for (j = 0; j < n_planes[index]; j++)
+			pool_put (buffers[index][i][j].pb);
+}
+
+static void
+pool_report                     (void)
+{
+	size_t used = 0, want = 0, idle = 0, classes[POOL_MAX];
+	unsigned int i, k, n_classes = 0;
+
+	for (i = 0; i < POOL_MAX; i++) {
+		if (!pool[i].size)
+			continue;
+		if (pool[i].used) {
+			used += pool[i].size;
+			want += pool[i].want;
+		} else {
+			idle += pool[i].size;
+		}
+		for (k = 0; k < n_classes && classes[k] != pool[i].size; k++)
+			;
+		if (k == n_classes)
+			classes[n_classes++] = pool[i].size;
+	}
+
+	printf("buffer pool: %zu KiB (peak %zu KiB) of %s%s, %zu KiB in use, %zu KiB idle, "
+	       "%u size class(es), %.1f%% lost to rounding, %u allocated, %u reused\n",
+	       pool_bytes >> 10, pool_peak >> 10,
+	       pool_budget ? "" : "unlimited", pool_budget ? "budget" : "",
+	       used >> 10, idle >> 10, n_classes,
+	       used ? (1.0 - (double)want / used) * 100.0 : 0.0,
+	       pool_allocs, pool_reuses);
+	if (pool_budget)
+		printf("budget %zu KiB, %.1f%% used at peak\n",
+		       pool_budget >> 10, (double)pool_peak / pool_budget * 100.0);
+}
+
+/* read the input of frame seq into OUT buffer i again */
+static void
+restore_input                   (int i, unsigned int seq)
+{
+	uint8_t *p[VIDEO_MAX_PLANES];
+	unsigned int k;
+
+	buffer_planes (OUT, i, p);
+	cpu_access (OUT, i, 1, 1);
+	if (input_fd >= 0) {
+		/* a reader of its own, in_stream stays where it is */
+		if (redo_stream.fd < 0) {
+			redo_stream = in_stream;
+			if (in_stream.direct &&
+			    posix_memalign ((void **)&redo_stream.stage, IO_ALIGN, in_stream.size))
+				errno_exit ("cannot allocate a staging buffer", NULL);
+		}
+		stream_seek (&redo_stream, input_off[seq % VIDEO_MAX_FRAME]);
+		if (repack_fmt)
+			repack_frame (&redo_stream, p, &pix_fmt[OUT]);
+		else
+			for (k = 0; k < n_planes[OUT]; k++)
+				stream_read (&redo_stream, p[k], pix_fmt[OUT].plane_fmt[k].sizeimage);
+	} else if (regress) {
+		fill_pattern (p, &pix_fmt[OUT], seq);
+	}
+	cpu_access (OUT, i, 0, 1);
+}
+
+/* the oldest frame waiting to be queued again, if any */
+static int
+take_redo                       (unsigned int *seq)
+{
+	if (!n_redo)
+		return 0;
+	*seq = redo_seq[0];
+	memmove (redo_seq, redo_seq + 1, --n_redo * sizeof(redo_seq[0]));
+	return 1;
+}
+
+static int
+submit_buffer                   (int fd, int index, struct v4l2_buffer *buf, unsigned int seq)
+{
+	int req_fd = -1;
+
+	if (index == OUT) {
+		if (use_requests)
+			req_fd = request_fd[buf->index];
+		if (n_params && req_fd >= 0)
+			apply_frame_params (seq, req_fd);
+#ifdef V4L2_BUF_FLAG_REQUEST_FD
+		if (req_fd >= 0) {
+			buf->flags |= V4L2_BUF_FLAG_REQUEST_FD;
+			buf->request_fd = req_fd;
+		}
+#endif
+		hw_submitted (seq);
+		out_buf_seq[buf->index] = seq;
+	}
+
+	if (io == IO_METHOD_DMABUF) {
+		unsigned int j;
+
+		for (j = 0; j < n_planes[index]; j++) {
+			buf->m.planes[j].m.fd = buffers[index][buf->index][j].pb->fd;
+			buf->m.planes[j].length = buffers[index][buf->index][j].length;
+		}
+	}
+	TRACE (qbuf, index, buf->index, (index == OUT) ? (int)seq : -1);
+	if (-1 == xioctl (fd, VIDIOC_QBUF, buf))
+		goto fail;
+
+#ifdef MEDIA_REQUEST_IOC_QUEUE
+	if (req_fd >= 0 && -1 == xioctl (req_fd, MEDIA_REQUEST_IOC_QUEUE, NULL))
+		goto fail;
+#endif
+	return 0;
+
+fail:
+	if (recovering)
+		return -1;
+	if (errno != EIO)
+		errno_exit ("VIDIOC_QBUF for ", ocstring[index]);
+	recover (index, "QBUF");
+	return -1;
+}
+
+static void
+enqueue_buffer                  (int fd, int index, struct v4l2_buffer *buf)
+{
+	submit_buffer (fd, index, buf, (index == OUT) ? out_seq++ : 0);
+}
+
+static void
+release_request                 (int index, struct v4l2_buffer *buf)
+{
+#ifdef MEDIA_REQUEST_IOC_REINIT
+	if (index == OUT && use_requests && request_fd[buf->index] >= 0)
+		if (-1 == xioctl (request_fd[buf->index], MEDIA_REQUEST_IOC_REINIT, NULL))
+			errno_exit ("MEDIA_REQUEST_IOC_REINIT for ", ocstring[index]);
+#endif
+}
+
+static int
+read_frame                      (int fd, int index, enum v4l2_buf_type buftype)
+{
+        struct v4l2_buffer buf;
+	uint8_t *p[VIDEO_MAX_PLANES];
+        unsigned int i, seq;
+
+        switch (io) {
+        case IO_METHOD_READ:
+                break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_DMABUF:
+                CLEAR (buf);
+
+                buf.type = buftype;
+                buf.memory = buf_memory ();
+		buf.m.planes = planes[index];
+		buf.length = n_planes[index];
+
+                if (-1 == xioctl (fd, VIDIOC_DQBUF, &buf)) {
+                        switch (errno) {
+                        case EAGAIN:
+                                return 0;
+
+                        case EIO:
+				recover (index, "EIO");
+				return -1;
+
+                        default:
+                                errno_exit ("VIDIOC_DQBUF for ", ocstring[index]);
+                        }
+                }
+
+                assert (buf.index < n_buffers[index]);
+		if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+			recover (index, "buffer error");
+			return -1;
+		}
+		TRACE (dqbuf, index, buf.index,
+		       (index == OUT) ? (int)out_buf_seq[buf.index] :
+		       (int)hw_fifo[hw_tail % VIDEO_MAX_FRAME].seq);
+		release_request (index, &buf);
+
+		if (index == CAP) {
+			if (histo_fd >= 0)
+				histo_skew = (int)buf.sequence - (int)histo_cap++;
+			cpu_access (index, buf.index, 1, 0);
+			emit_hw_frame (buf.index);
+			cpu_access (index, buf.index, 0, 0);
+		        fputc ('I', stdout);
+			fflush (stdout);
+		} else {
+			offload_frames ();
+			if (take_redo (&seq)) {
+				/* a frame lost in a recovery goes first */
+				restore_input (buf.index, seq);
+				for (i=0; i<n_planes[index]; i++)
+					planes[index][i].bytesused =
+						pix_fmt[index].plane_fmt[i].sizeimage;
+				submit_buffer (fd, index, &buf, seq);
+				break;
+			}
+			if (input_fd >= 0 || regress) {
+				buffer_planes (index, buf.index, p);
+				cpu_access (index, buf.index, 1, 1);
+				while (out_seq < frame_count &&
+				       read_input (p, &pix_fmt[index]))
+					repeat_frame (out_seq++);
+				cpu_access (index, buf.index, 0, 1);
+				for (i=0; i<n_planes[index]; i++)
+					planes[index][i].bytesused =
+						pix_fmt[index].plane_fmt[i].sizeimage;
+			        fputc ('o', stdout);
+				fflush (stdout);
+			}
+		}
+
+                enqueue_buffer (fd, index, &buf);
+                break;
+
+        case IO_METHOD_USERPTR:
+                break;
+        }
+
+        return 1;
+}
+
+static void
+mainloop                        (void)
+{
+        unsigned int count;
+
+        count = frame_count;
+
+        while (emit_seq + live_drops < count) {
+                fd_set fds;
+                struct timeval tv;
+                int r, nfds = v4lcap_fd;
+		double due;
+
+                FD_ZERO (&fds);
+                FD_SET (v4lcap_fd, &fds);
+		if (cpu_pipe[0] >= 0) {
+			FD_SET (cpu_pipe[0], &fds);
+			if (cpu_pipe[0] > nfds)
+				nfds = cpu_pipe[0];
+		}
+		if (histo_fd >= 0) {
+			FD_SET (histo_fd, &fds);
+			if (histo_fd > nfds)
+				nfds = histo_fd;
+		}
+
+                /* Timeout. */
+                tv.tv_sec = 2;
+                tv.tv_usec = 0;
+		due = monotonic_sec () + tv.tv_sec;
+
+                r = select (nfds + 1, &fds, NULL, NULL, &tv);
+
+                if (-1 == r) {
+                        if (EINTR == errno)
+                                continue;
+
+                        errno_exit ("select for cap", NULL);
+                }
+
+                if (0 == r) {
+			if (rt_report)
+				log_wakeup (due);
+                        fprintf (stderr, "select timeout\n");
+			recover (CAP, "timeout");
+			continue;
+                }
+
+		/* collect frames converted by the CPU workers */
+		if (cpu_pipe[0] >= 0 && FD_ISSET (cpu_pipe[0], &fds))
+			collect_cpu_frames ();
+
+		if (histo_fd >= 0 && FD_ISSET (histo_fd, &fds))
+			read_histogram ();
+
+		/* dequeue a capture buffer and read it */
+		r = 0;
+		if (FD_ISSET (v4lcap_fd, &fds))
+			r = read_frame (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+		if (lut_entries)
+			swap_lut ();
+
+		/* a format switch or parameters are due: drain, then apply */
+		if (switch_due () || params_due ()) {
+			if (emit_seq == out_seq && switch_due ())
+				reconfigure ();
+			else if (emit_seq == out_seq)
+				apply_due_params ();
+			continue;
+		}
+
+		if (r <= 0)
+			continue; /* EAGAIN or recovered - continue select loop. */
+
+		/* dequeue an output buffer and refill it */
+		do {
+			r = read_frame (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+		} while (!r);
+        }
+	printf("finishing...\n");
+}
+
+static void
+stop_capturing                  (int fd, int index, enum v4l2_buf_type buftype)
+{
+        switch (io) {
+        case IO_METHOD_READ:
+                /* Nothing to do. */
+                break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_USERPTR:
+        case IO_METHOD_DMABUF:
+
+		printf("stop streaming... ");fflush(stdout);
+                if (-1 == xioctl (fd, VIDIOC_STREAMOFF, &buftype))
+                        errno_exit ("VIDIOC_STREAMOFF for ", dev_name[index]);
+		printf("done.\n");
+                break;
+        }
+}
+
+static void
+queue_buffers                (int fd, int index, enum v4l2_buf_type buftype)
+{
+	uint8_t *p[VIDEO_MAX_PLANES];
+        unsigned int i;
+
+        switch (io) {
+        case IO_METHOD_READ:
+                /* Nothing to do. */
+                break;
+
+        case IO_METHOD_MMAP:
+        case IO_METHOD_DMABUF:
+                for (i = 0; i < n_buffers[index]; ++i) {
+                        struct v4l2_buffer buf;
+			int j;
+
+			/* the rest waits for the switch or parameters */
+			if (index == OUT && (switch_due () || params_due ()))
+				break;
+
+                        CLEAR (buf);
+
+                        buf.type        = buftype;
+                        buf.memory      = buf_memory ();
+                        buf.index       = i;
+			buf.m.planes    = planes[index];
+			buf.length      = n_planes[index];
+
+			if ((index == OUT) && (input_fd >= 0 || regress)) {
+				buffer_planes (index, i, p);
+				cpu_access (index, i, 1, 1);
+				read_input (p, &pix_fmt[index]);
+				cpu_access (index, i, 0, 1);
+				for (j=0; j<n_planes[index]; j++)
+					planes[index][j].bytesused =
+						pix_fmt[index].plane_fmt[j].sizeimage;
+			}
+                        enqueue_buffer (fd, index, &buf);
+			printf("%s[%d] queued\n", ocstring[index], i);
+                }
+
+                break;
+
+        case IO_METHOD_USERPTR:
+                break;
+        }
+}
+
+static void
+start_capturing                 (int fd, int index, enum v4l2_buf_type buftype)
+{
+        unsigned int i;
+
+        if (-1 == xioctl (fd, VIDIOC_STREAMON, &buftype))
+		errno_exit ("VIDIOC_STREAMON for ", ocstring[index]);
+}
+
+static void
+uninit_device                   (int index)
+{
+        unsigned int i, j;
+
+        switch (io) {
+        case IO_METHOD_READ:
+                break;
+
+        case IO_METHOD_MMAP:
+		printf("unmapping ... ");
+                for (i = 0; i < n_buffers[index]; ++i) {
+			for (j = 0; j < n_planes[index]; ++j)
+				if (-1 == munmap (buffers[index][i][j].start, buffers[index][i][j].length))
+					errno_exit ("munmap for ", dev_name[index]);
+			printf("[%d] ", i);fflush(stdout);
+		}
+		printf("done.\n");
+
+                break;
+
+        case IO_METHOD_DMABUF:
+		uninit_dmabuf_queue (index);
+                break;
+
+        case IO_METHOD_USERPTR:
+                break;
+        }
+}
+
+static void
+init_mmap                       (int fd, int index, enum v4l2_buf_type buftype, int n_bufs)
+{
+        struct v4l2_requestbuffers req;
+
+	/* input buffer */
+        CLEAR (req);
+
+        req.count               = n_bufs;
+        req.type                = buftype;
+        req.memory              = V4L2_MEMORY_MMAP;
+
+        if (-1 == xioctl (fd, VIDIOC_REQBUFS, &req)) {
+                if (EINVAL == errno) {
+                        fprintf (stderr, "%s does not support "
+                                 "memory mapping\n", dev_name[index]);
+			errno_exit("VIDIOC_REQBUFS for ", dev_name[index]);
+                } else {
+                        errno_exit ("VIDIOC_REQBUFS for ", dev_name[index]);
+                }
+        }
+
+	printf("req.count = %d\n", req.count);
+	n_bufs = req.count;
+#ifdef V4L2_BUF_CAP_SUPPORTS_REQUESTS
+	buf_caps[index] = req.capabilities;
+#endif
+
+        for (n_buffers[index] = 0; n_buffers[index] < n_bufs; ++n_buffers[index]) {
+                struct v4l2_buffer buf;
+		int i;
+
+                CLEAR (buf);
+                memset((void *)planes[index], 0,
+		       sizeof(struct v4l2_plane) * VIDEO_MAX_PLANES);
+
+                buf.type        = buftype;
+                buf.memory      = V4L2_MEMORY_MMAP;
+                buf.index       = n_buffers[index];
+		buf.m.planes    = planes[index];
+		buf.length      = n_planes[index];
+
+                if (-1 == xioctl (fd, VIDIOC_QUERYBUF, &buf))
+                        errno_exit ("VIDIOC_QUERYBUF for ", dev_name[index]);
+
+		printf("n_planes = %d\n", buf.length);
+		n_planes[index] = buf.length;
+		for (i=0; i<n_planes[index]; i++) {
+			printf("m.plane[%d].length = %d, m.plane[%d].m.mem_offset = %08x\n",
 			       i, planes[index][i].length,
 			       i, planes[index][i].m.mem_offset);
 
@@ -373,6 +3282,22 @@ init_mmap                       (int fd, int index, enum v4l2_buf_type buftype,
 	printf("done\n");
 }
 
+static void
+release_buffers                 (int fd, int index, enum v4l2_buf_type buftype)
+{
+        struct v4l2_requestbuffers req;
+
+        CLEAR (req);
+
+        req.count               = 0;
+        req.type                = buftype;
+        req.memory              = buf_memory ();
+
+        if (-1 == xioctl (fd, VIDIOC_REQBUFS, &req))
+		errno_exit ("VIDIOC_REQBUFS for ", dev_name[index]);
+	n_buffers[index] = 0;
+}
+
 static int fgets_with_openclose(char *fname, char *buf, size_t maxlen)
 {
 	FILE *fp;
@@ -401,6 +3326,7 @@ init_entity_pad (int fd, int index, uint32_t pad, uint32_t width, uint32_t heigh
 	sfmt.format.code = code;
 	sfmt.format.field = V4L2_FIELD_NONE;
 	sfmt.format.colorspace = V4L2_COLORSPACE_SRGB;
+	TRACE (pad_fmt, index, pad, -1);
 	
         if (-1 == xioctl (fd, VIDIOC_SUBDEV_S_FMT, &sfmt))
                 errno_exit ("VIDIOC_SUBDEV_S_FMT for ", entity_name[index]);
@@ -428,15 +3354,106 @@ open_v4lsubdev(char *prefix, char *target, char *path)
 	return -1;
 }
 
+/* -t/-H/-V in the WPF if it can, with write_frame() as the fallback */
+static void
+setup_orientation               (void)
+{
+	struct v4l2_ext_controls ctrls;
+	struct v4l2_ext_control ctrl[3];
+
+	if (!orient_requested ())
+		return;
+
+	CLEAR (ctrls);
+	CLEAR (ctrl);
+	ctrl[0].id = V4L2_CID_HFLIP;
+	ctrl[0].value = hflip;
+	ctrl[1].id = V4L2_CID_VFLIP;
+	ctrl[1].value = vflip;
+	ctrl[2].id = V4L2_CID_ROTATE;
+	ctrl[2].value = rotation;
+	ctrls.count = rotation ? 3 : 2;
+	ctrls.controls = ctrl;
+
+	if (0 == xioctl (v4lsub_fd[CAP], VIDIOC_S_EXT_CTRLS, &ctrls)) {
+		hw_orient = 1;
+		printf("rotation %d%s%s in the WPF\n", rotation,
+		       hflip ? ", hflip" : "", vflip ? ", vflip" : "");
+		if (n_workers && !orient_bpp (format[CAP])) {
+			fprintf (stderr, "no CPU rotation for this format, CPU workers disabled\n");
+			n_workers = 0;
+		}
+		return;
+	}
+
+	if (!orient_bpp (format[CAP])) {
+		fprintf (stderr, "%s cannot rotate/flip (%d, %s) and the CPU only handles packed RGB\n",
+			 entity_name[CAP], errno, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	printf("rotation %d%s%s on the CPU\n", rotation,
+	       hflip ? ", hflip" : "", vflip ? ", vflip" : "");
+}
+
+static int
+set_format                      (int fd, int index, enum v4l2_buf_type buftype)
+{
+        struct v4l2_format fmt;
+        unsigned int min, i;
+
+        CLEAR (fmt);
+
+        fmt.type                = buftype;
+        fmt.fmt.pix_mp.width       = width[index];
+        fmt.fmt.pix_mp.height      = height[index];
+	if (index == CAP && hw_orient && (rotation % 180)) {
+		fmt.fmt.pix_mp.width       = height[index];
+		fmt.fmt.pix_mp.height      = width[index];
+	}
+        fmt.fmt.pix_mp.pixelformat = format[index];
+        fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+
+	TRACE (s_fmt, index, -1, -1);
+        if (-1 == xioctl (fd, VIDIOC_S_FMT, &fmt))
+		return -1;
+
+	printf("pixelformat = %c%c%c%c (%c%c%c%c)\n",
+	       (fmt.fmt.pix_mp.pixelformat >> 0) & 0xff,
+	       (fmt.fmt.pix_mp.pixelformat >> 8) & 0xff,
+	       (fmt.fmt.pix_mp.pixelformat >> 16) & 0xff,
+	       (fmt.fmt.pix_mp.pixelformat >> 24) & 0xff,
+	       (format[index] >> 0) & 0xff,
+	       (format[index] >> 8) & 0xff,
+	       (format[index] >> 16) & 0xff,
+	       (format[index] >> 24) & 0xff);
+	printf("num_planes = %d\n", fmt.fmt.pix_mp.num_planes);
+	for (i=0; i<fmt.fmt.pix_mp.num_planes; i++) {
+		printf("plane_fmt[%d].sizeimage = %d\n",
+		       i, fmt.fmt.pix_mp.plane_fmt[i].sizeimage);
+		printf("plane_fmt[%d].bytesperline = %d\n",
+		       i, fmt.fmt.pix_mp.plane_fmt[i].bytesperline);
+	}
+        /* Note VIDIOC_S_FMT may change width and height. */
+#if 0
+        /* Buggy driver paranoia. */
+        min = fmt.fmt.pix_mp.width * 2;
+        if (fmt.fmt.pix_mp.bytesperline < min)
+                fmt.fmt.pix_mp.bytesperline = min;
+        min = fmt.fmt.pix_mp.bytesperline * fmt.fmt.pix_mp.height;
+        if (fmt.fmt.pix_mp.sizeimage < min)
+                fmt.fmt.pix_mp.sizeimage = min;
+#endif
+	pix_fmt[index] = fmt.fmt.pix_mp;
+	return 0;
+}
+
 static void
 init_device                     (int fd, int index, uint32_t captype, enum v4l2_buf_type buftype)
 {
         struct v4l2_capability cap;
         struct v4l2_cropcap cropcap;
         struct v4l2_crop crop;
-        struct v4l2_format fmt;
-        unsigned int min, i;
-	char *p;
+	char *p, *save;
 	char path[256];
 
         if (-1 == xioctl (fd, VIDIOC_QUERYCAP, &cap)) {
@@ -451,15 +3468,17 @@ init_device                     (int fd, int index, uint32_t captype, enum v4l2_
 
 	/* look for a counterpart */
 	p = strdup(cap.card);
-	p = strtok(p, " ");
+	p = strtok_r(p, " ", &save);
+	pthread_mutex_lock (&init_lock);
 	if (ip_name == NULL) {
 		ip_name = p;
 		printf("ip_name = %s\n", ip_name);
 	} else if (strcmp(ip_name, p) != 0) {
 		errno_exit("ip name mismatch", NULL);
 	}
+	pthread_mutex_unlock (&init_lock);
 
-	entity_name[index] = strtok(NULL, " ");
+	entity_name[index] = strtok_r(NULL, " ", &save);
 	if (entity_name[index] == NULL) {
 		errno_exit("entity name not found. in ", cap.card);
 	}
@@ -473,6 +3492,15 @@ init_device                     (int fd, int index, uint32_t captype, enum v4l2_
                 exit (EXIT_FAILURE);
 	}
 
+	if (index == CAP)
+		setup_orientation ();
+
+	/* names are known: the media device can be looked up now */
+	pthread_mutex_lock (&init_lock);
+	n_probed++;
+	pthread_cond_broadcast (&init_cond);
+	pthread_mutex_unlock (&init_lock);
+
         if (!(cap.capabilities & captype)) {
                 fprintf (stderr, "%s is not suitable device (%08x != %08x)\n",
                          dev_name[index], cap.capabilities, captype);
@@ -491,6 +3519,7 @@ init_device                     (int fd, int index, uint32_t captype, enum v4l2_
 
         case IO_METHOD_MMAP:
         case IO_METHOD_USERPTR:
+        case IO_METHOD_DMABUF:
                 if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
                         fprintf (stderr, "%s does not support streaming i/o\n",
                                  dev_name[index]);
@@ -527,45 +3556,15 @@ init_device                     (int fd, int index, uint32_t captype, enum v4l2_
         }
 
 
-        CLEAR (fmt);
-
-        fmt.type                = buftype;
-        fmt.fmt.pix_mp.width       = width[index];
-        fmt.fmt.pix_mp.height      = height[index];
-        fmt.fmt.pix_mp.pixelformat = format[index];
-        fmt.fmt.pix_mp.field       = V4L2_FIELD_NONE;
+	if (-1 == set_format (fd, index, buftype)) {
+		int err = errno;
 
-        if (-1 == xioctl (fd, VIDIOC_S_FMT, &fmt)) {
-		printf("%s: \n", dev_name[index]);
+		/* enumerated only when needed, it costs a few ioctls */
+		list_formats (fd, index, buftype);
+		errno = err;
                 errno_exit ("VIDIOC_S_FMT for ", dev_name[index]);
 	}
 
-	printf("pixelformat = %c%c%c%c (%c%c%c%c)\n",
-	       (fmt.fmt.pix_mp.pixelformat >> 0) & 0xff,
-	       (fmt.fmt.pix_mp.pixelformat >> 8) & 0xff,
-	       (fmt.fmt.pix_mp.pixelformat >> 16) & 0xff,
-	       (fmt.fmt.pix_mp.pixelformat >> 24) & 0xff,
-	       (format[index] >> 0) & 0xff,
-	       (format[index] >> 8) & 0xff,
-	       (format[index] >> 16) & 0xff,
-	       (format[index] >> 24) & 0xff);
-	printf("num_planes = %d\n", fmt.fmt.pix_mp.num_planes);
-	for (i=0; i<fmt.fmt.pix_mp.num_planes; i++) {
-		printf("plane_fmt[%d].sizeimage = %d\n",
-		       i, fmt.fmt.pix_mp.plane_fmt[i].sizeimage);
-		printf("plane_fmt[%d].bytesperline = %d\n",
-		       i, fmt.fmt.pix_mp.plane_fmt[i].bytesperline);
-	}
-        /* Note VIDIOC_S_FMT may change width and height. */
-#if 0
-        /* Buggy driver paranoia. */
-        min = fmt.fmt.pix_mp.width * 2;
-        if (fmt.fmt.pix_mp.bytesperline < min)
-                fmt.fmt.pix_mp.bytesperline = min;
-        min = fmt.fmt.pix_mp.bytesperline * fmt.fmt.pix_mp.height;
-        if (fmt.fmt.pix_mp.sizeimage < min)
-                fmt.fmt.pix_mp.sizeimage = min;
-#endif
         switch (io) {
         case IO_METHOD_READ:
         case IO_METHOD_USERPTR:
@@ -574,6 +3573,10 @@ init_device                     (int fd, int index, uint32_t captype, enum v4l2_
         case IO_METHOD_MMAP:
                 init_mmap (fd, index, buftype, N_BUFFERS);
                 break;
+
+        case IO_METHOD_DMABUF:
+                /* run_pipeline() sizes both queues from the pool */
+                break;
         }
 }
 
@@ -588,15 +3591,6 @@ close_device                    (int fd, int index)
         fd = -1;
 }
 
-double gettimeofday_sec()
-{
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-
-	return tv.tv_sec + tv.tv_usec * 1e-6;
-}
-
 
 static int
 open_device                     (char *name)
@@ -702,6 +3696,7 @@ activate_link (struct media_entity_desc *src, struct media_entity_desc *sink)
 		return -1;
 
 	target_link->flags |= MEDIA_LNK_FL_ENABLED;
+	TRACE (link, -1, src->id, sink->id);
 	return ioctl(media_fd, MEDIA_IOC_SETUP_LINK, target_link);
 }
 
@@ -746,43 +3741,799 @@ deactivate_link (struct media_entity_desc *src)
 		}
 	}
 
-	free (links.pads);
-	free (links.links);
-
-	return ret;
+	free (links.pads);
+	free (links.links);
+
+	return ret;
+}
+
+/*
+ * Like activate_link(), but for a second link out of a source pad that
+ * already feeds the pipeline, as the histogram engines are connected.
+ */
+static int
+tap_link                        (struct media_entity_desc *src, struct media_entity_desc *sink)
+{
+	struct media_links_enum links;
+	int i, ret = -1;
+
+	CLEAR (links);
+	links.pads = malloc(sizeof(struct media_pad_desc) * src->pads);
+	links.links = malloc(sizeof(struct media_link_desc) * src->links);
+	links.entity = src->id;
+
+	if (0 == ioctl(media_fd, MEDIA_IOC_ENUM_LINKS, &links))
+		for (i = 0; i < src->links; i++)
+			if (links.links[i].sink.entity == sink->id) {
+				links.links[i].flags |= MEDIA_LNK_FL_ENABLED;
+				TRACE (link, -1, src->id, sink->id);
+				ret = ioctl(media_fd, MEDIA_IOC_SETUP_LINK, &links.links[i]);
+				break;
+			}
+
+	free (links.pads);
+	free (links.links);
+
+	return ret;
+}
+
+static int
+confirm_link (struct media_entity_desc *src, struct media_entity_desc *sink)
+{
+	struct media_links_enum links;
+	struct media_link_desc link;
+	int pad_index, ret, i;
+
+	printf("src.pads = %d, src.links = %d\n", src->pads, src->links);
+	CLEAR (links);
+	links.pads = malloc(sizeof(struct media_pad_desc) * src->pads);
+	links.links = malloc(sizeof(struct media_link_desc) * src->links);
+
+	links.entity = src->id;
+	ret = ioctl(media_fd, MEDIA_IOC_ENUM_LINKS, &links);
+
+	/* find a link to the sink entity */
+	for (i=0; i<src->links; i++) {
+		pad_index = links.links[i].source.index;
+		printf("pad_index = %d, links.links[%d].sink.entity = %d\n",
+		       pad_index, i, links.links[i].sink.entity);
+		if ((links.pads[pad_index].flags & MEDIA_PAD_FL_SOURCE) &&
+		    (links.links[i].sink.entity == sink->id)) {
+			printf("A link from entity-%d to entity-%d is %s!\n",
+			       src->id, sink->id,
+			       (links.links[i].flags & MEDIA_LNK_FL_ENABLED) ? "ENABLED" : "DISABLED");
+			return ((links.links[i].flags & MEDIA_LNK_FL_ENABLED) == 0);
+		}
+	}
+
+	printf("Link from entity-%d to entity-%d! not found.\n", src->id, sink->id);
+	return -1;
+}
+
+/* the UDS is needed when what the RPF passes on, w x h or the crop, isn't the output size */
+static int
+scaled_from                     (int w, int h)
+{
+	if (crop.width) {
+		w = crop.width;
+		h = crop.height;
+	}
+	return (w != width[CAP]) || (h != height[CAP]);
+}
+
+static int
+is_scaled                       (void)
+{
+	return scaled_from (width[OUT], height[OUT]);
+}
+
+static void
+open_entity                     (int index)
+{
+	char path[256], tmp[256];
+	int ret;
+
+	if (v4lsub_fd[index] >= 0)
+		return;
+
+	v4lsub_fd[index] = open_v4lsubdev (ip_name, entity_name[index], path);
+	if (v4lsub_fd[index] < 0)
+		errno_exit("cannot open a subdev file for ", entity_name[index]);
+
+	sprintf(tmp, "%s %s", ip_name, entity_name[index]);
+	ret = get_media_entity (tmp, &entity[index]);
+	if (ret < 0) {
+		fprintf(stderr, "Entity for %s not found.\n", entity_name[index]);
+		exit (EXIT_FAILURE);
+	}
+	printf("A entity for %s found.\n", entity_name[index]);
+}
+
+/* RPF -> [UDS] -> [LUT/CLU] -> WPF */
+static void
+setup_links                     (void)
+{
+	int chain[NR_ENTITIES], n = 0, i, ret;
+
+	/* Deactivate the current pipeline. */
+	deactivate_link (&entity[OUT]);
+
+	chain[n++] = OUT;
+	if (is_scaled ())
+		chain[n++] = RESZ;
+	if (lut_entries)
+		chain[n++] = LUT;
+	chain[n++] = CAP;
+
+	for (i = 1; i < n - 1; i++)
+		open_entity (chain[i]);
+
+	for (i = 0; i < n - 1; i++) {
+		ret = activate_link (&entity[chain[i]], &entity[chain[i + 1]]);
+		if (ret) {
+			fprintf(stderr, "Cannot enable a link from %s to %s\n",
+				entity_name[chain[i]], entity_name[chain[i + 1]]);
+			exit (EXIT_FAILURE);
+		}
+		printf("A link from %s to %s enabled.\n",
+		       entity_name[chain[i]], entity_name[chain[i + 1]]);
+	}
+
+	/* the HGO sees what the WPF gets */
+	if (histo_name) {
+		histo_tap = chain[n - 2];
+		open_entity (HGO);
+		if (tap_link (&entity[histo_tap], &entity[HGO])) {
+			fprintf(stderr, "Cannot enable a link from %s to %s\n",
+				entity_name[histo_tap], entity_name[HGO]);
+			exit (EXIT_FAILURE);
+		}
+		printf("A link from %s to %s enabled.\n",
+		       entity_name[histo_tap], entity_name[HGO]);
+	}
+}
+
+static void
+setup_pads                      (void)
+{
+	int w = crop.width ? (int)crop.width : width[OUT];
+	int h = crop.width ? (int)crop.height : height[OUT];
+
+	if (is_scaled ()) {
+		init_entity_pad (v4lsub_fd[RESZ], RESZ, 0, w, h, code[CAP]);
+		init_entity_pad (v4lsub_fd[RESZ], RESZ, 1, width[CAP], height[CAP], code[CAP]);
+	}
+	if (lut_entries) {
+		init_entity_pad (v4lsub_fd[LUT], LUT, 0, width[CAP], height[CAP], code[CAP]);
+		init_entity_pad (v4lsub_fd[LUT], LUT, 1, width[CAP], height[CAP], code[CAP]);
+	}
+
+	/* sink pad in RPF, then its crop window, which resets with the format */
+	init_entity_pad (v4lsub_fd[OUT], OUT, 0, width[OUT], height[OUT], code[OUT]);
+	if (crop.width)
+		set_crop (v4lsub_fd[OUT], &crop);
+	/* source pad in RPF */
+	init_entity_pad (v4lsub_fd[OUT], OUT, 1, w, h, code[CAP]);
+	/* sink pad in WPF */
+	init_entity_pad (v4lsub_fd[CAP], CAP, 0, width[CAP], height[CAP], code[CAP]);
+	/* sink pad in HGO, as the tapped source pad */
+	if (histo_name) {
+		if (histo_tap == OUT)
+			init_entity_pad (v4lsub_fd[HGO], HGO, 0, w, h, code[CAP]);
+		else
+			init_entity_pad (v4lsub_fd[HGO], HGO, 0, width[CAP], height[CAP], code[CAP]);
+	}
+	/* source pad in WPF, rotated */
+	if (hw_orient && (rotation % 180))
+		init_entity_pad (v4lsub_fd[CAP], CAP, 1, height[CAP], width[CAP], code[CAP]);
+	else
+		init_entity_pad (v4lsub_fd[CAP], CAP, 1, width[CAP], height[CAP], code[CAP]);
+}
+
+/*
+ * HGO statistics come out of a metadata capture node. The driver skips
+ * the histogram of a frame when no HGO buffer is queued, so records are
+ * matched by buf.sequence, the pipeline's frame counter: histo_fifo
+ * holds the seq of every frame in the order hw_submitted() queued it
+ * since STREAMON, and the CAP buffers' sequence numbers (histo_skew)
+ * keep that index in step with the driver's. The HGO node is started
+ * before OUT/CAP so that the first frames have buffers too. The sidecar
+ * holds per frame: uint32_t seq, uint32_t bytes, then 'bytes' of
+ * V4L2_META_FMT_VSP1_HGO data.
+ */
+static int
+queue_histogram                 (unsigned int i)
+{
+	struct v4l2_buffer buf;
+
+	CLEAR (buf);
+	buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = i;
+
+	return xioctl (histo_fd, VIDIOC_QBUF, &buf);
+}
+
+static void
+init_histogram                  (void)
+{
+	struct v4l2_requestbuffers req;
+	struct v4l2_format fmt;
+	struct v4l2_buffer buf;
+	char path[256], name[256], want[256];
+	unsigned int i;
+
+	snprintf (want, sizeof(want), "%s %s histo", ip_name, entity_name[HGO]);
+	for (i = 0; i < 256 && histo_fd < 0; i++) {
+		snprintf (path, sizeof(path), "/sys/class/video4linux/video%d/name", i);
+		if (fgets_with_openclose (path, name, sizeof(name)) < 0)
+			continue;
+		name[strcspn (name, "\n")] = '\0';	/* sysfs ends the name with one */
+		if (strcmp (name, want))
+			continue;
+		snprintf (path, sizeof(path), "/dev/video%d", i);
+		histo_fd = open (path, O_RDWR | O_NONBLOCK, 0);
+		if (histo_fd < 0)
+			errno_exit ("cannot open ", path);
+		printf("histogram node = %s\n", path);
+	}
+	if (histo_fd < 0)
+		errno_exit ("no video node for ", want);
+
+	CLEAR (fmt);
+	fmt.type = V4L2_BUF_TYPE_META_CAPTURE;
+	fmt.fmt.meta.dataformat = V4L2_META_FMT_VSP1_HGO;
+	if (-1 == xioctl (histo_fd, VIDIOC_S_FMT, &fmt))
+		errno_exit ("VIDIOC_S_FMT for ", ocstring[HGO]);
+
+	CLEAR (req);
+	req.count = HISTO_BUFFERS;
+	req.type = V4L2_BUF_TYPE_META_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (-1 == xioctl (histo_fd, VIDIOC_REQBUFS, &req))
+		errno_exit ("VIDIOC_REQBUFS for ", ocstring[HGO]);
+	n_histo_bufs = (req.count < HISTO_BUFFERS) ? req.count : HISTO_BUFFERS;
+
+	for (i = 0; i < n_histo_bufs; i++) {
+		CLEAR (buf);
+		buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		buf.index = i;
+		if (-1 == xioctl (histo_fd, VIDIOC_QUERYBUF, &buf))
+			errno_exit ("VIDIOC_QUERYBUF for ", ocstring[HGO]);
+		histo_buf[i].length = buf.length;
+		histo_buf[i].start = mmap (NULL, buf.length, PROT_READ | PROT_WRITE,
+					   MAP_SHARED, histo_fd, buf.m.offset);
+		if (MAP_FAILED == histo_buf[i].start)
+			errno_exit ("mmap for ", ocstring[HGO]);
+		if (-1 == queue_histogram (i))
+			errno_exit ("VIDIOC_QBUF for ", ocstring[HGO]);
+	}
+
+	histo_file = fopen (histo_name, "w");
+	if (!histo_file)
+		errno_exit ("cannot open ", histo_name);
+}
+
+static void
+start_histogram                 (void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+
+	if (-1 == xioctl (histo_fd, VIDIOC_STREAMON, &type))
+		errno_exit ("VIDIOC_STREAMON for ", ocstring[HGO]);
+}
+
+static void
+read_histogram                  (void)
+{
+	struct v4l2_buffer buf;
+	uint32_t hdr[2];
+	unsigned int i;
+
+	for (;;) {
+		CLEAR (buf);
+		buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+		buf.memory = V4L2_MEMORY_MMAP;
+		if (-1 == xioctl (histo_fd, VIDIOC_DQBUF, &buf)) {
+			if (errno == EAGAIN)
+				return;
+			errno_exit ("VIDIOC_DQBUF for ", ocstring[HGO]);
+		}
+
+		i = buf.sequence - histo_skew;
+		hdr[0] = (i < histo_head && histo_head - i <= VIDEO_MAX_FRAME) ?
+			 histo_fifo[i % VIDEO_MAX_FRAME] : (uint32_t)-1;
+		if (i + 1 > histo_seen && i < histo_head)
+			histo_seen = i + 1;
+		hdr[1] = buf.bytesused;
+		TRACE (histogram, HGO, buf.index, (int)hdr[0]);
+		if (!(buf.flags & V4L2_BUF_FLAG_ERROR) && hdr[0] < frame_count) {
+			fwrite (hdr, sizeof(hdr), 1, histo_file);
+			fwrite (histo_buf[buf.index].start, 1, buf.bytesused, histo_file);
+			n_histos++;
+		}
+		if (-1 == queue_histogram (buf.index))
+			errno_exit ("VIDIOC_QBUF for ", ocstring[HGO]);
+	}
+}
+
+/* statistics of the last frames may still be on their way */
+static void
+drain_histogram                 (void)
+{
+	struct timeval tv;
+	fd_set fds;
+
+	while (histo_seen < histo_head &&
+	       histo_fifo[histo_seen % VIDEO_MAX_FRAME] < frame_count) {
+		FD_ZERO (&fds);
+		FD_SET (histo_fd, &fds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		if (select (histo_fd + 1, &fds, NULL, NULL, &tv) <= 0)
+			break;
+		read_histogram ();
+	}
+}
+
+static int
+restart_histogram               (void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+	unsigned int i;
+
+	if (-1 == xioctl (histo_fd, VIDIOC_STREAMOFF, &type))
+		return -1;
+	for (i = 0; i < n_histo_bufs; i++)
+		if (-1 == queue_histogram (i))
+			return -1;
+	histo_head = histo_seen = histo_cap = 0;
+	histo_skew = 0;
+
+	return xioctl (histo_fd, VIDIOC_STREAMON, &type);
+}
+
+static void
+uninit_histogram                (void)
+{
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+	unsigned int i;
+
+	drain_histogram ();
+	xioctl (histo_fd, VIDIOC_STREAMOFF, &type);
+	for (i = 0; i < n_histo_bufs; i++)
+		munmap (histo_buf[i].start, histo_buf[i].length);
+	close (histo_fd);
+	histo_fd = -1;
+	fclose (histo_file);
+	printf("%u histograms written to %s\n", n_histos, histo_name);
+}
+
+/*
+ * Restart both queues in place. Every frame the VSP has not returned is
+ * moved to the redo list and queued again, oldest first, with its input
+ * read again from where read_input() found it; the OUT buffers have
+ * usually been refilled with newer input already. A frame stays on the
+ * redo list or in hw_fifo until it is queued, so a restart that fails
+ * half way loses nothing. Redo frames that don't fit in the OUT queue
+ * are queued by read_frame() as buffers come back.
+ */
+static int
+restart_queues                  (unsigned int *requeued)
+{
+	enum v4l2_buf_type out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	enum v4l2_buf_type cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	struct v4l2_buffer buf;
+	unsigned int i, j, seq;
+	uint8_t *p[VIDEO_MAX_PLANES];
+
+	if (-1 == xioctl (v4lout_fd, VIDIOC_STREAMOFF, &out_type) ||
+	    -1 == xioctl (v4lcap_fd, VIDIOC_STREAMOFF, &cap_type))
+		return -1;
+	reset_requests ();
+	/* the HGO has buffers before any frame is queued again */
+	if (histo_fd >= 0 && -1 == restart_histogram ())
+		return -1;
+
+	while (hw_inflight) {
+		redo_seq[n_redo++] = hw_fifo[hw_tail % VIDEO_MAX_FRAME].seq;
+		hw_tail++;
+		hw_inflight--;
+	}
+	hw_head = hw_tail;
+
+	*requeued = 0;
+	for (j = 0; j < n_buffers[OUT]; j++) {
+		CLEAR (buf);
+		buf.type = out_type;
+		buf.memory = buf_memory ();
+		buf.index = j;
+		buf.m.planes = planes[OUT];
+		buf.length = n_planes[OUT];
+		for (i = 0; i < n_planes[OUT]; i++)
+			planes[OUT][i].bytesused = pix_fmt[OUT].plane_fmt[i].sizeimage;
+
+		if (take_redo (&seq)) {
+			restore_input (j, seq);
+			(*requeued)++;
+		} else {
+			buffer_planes (OUT, j, p);
+			cpu_access (OUT, j, 1, 1);
+			read_input (p, &pix_fmt[OUT]);
+			cpu_access (OUT, j, 0, 1);
+			seq = out_seq++;
+		}
+		if (-1 == submit_buffer (v4lout_fd, OUT, &buf, seq))
+			return -1;
+	}
+
+	for (j = 0; j < n_buffers[CAP]; j++) {
+		CLEAR (buf);
+		buf.type = cap_type;
+		buf.memory = buf_memory ();
+		buf.index = j;
+		buf.m.planes = planes[CAP];
+		buf.length = n_planes[CAP];
+		if (-1 == submit_buffer (v4lcap_fd, CAP, &buf, 0))
+			return -1;
+	}
+
+	if (-1 == xioctl (v4lout_fd, VIDIOC_STREAMON, &out_type) ||
+	    -1 == xioctl (v4lcap_fd, VIDIOC_STREAMON, &cap_type))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Get streaming again after an error without tearing the pipeline down:
+ * restart the queues, and only if that fails relink the entities and
+ * try once more.
+ */
+static void
+recover                         (int index, const char *why)
+{
+	enum v4l2_buf_type out_type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	enum v4l2_buf_type cap_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	unsigned int requeued = 0;
+	int relinked = 0;
+	double t1, t2;
+
+	if (++recover_streak > RECOVER_RETRIES) {
+		fprintf (stderr, "giving up recovering %s after %u attempts\n",
+			 ocstring[index], RECOVER_RETRIES);
+		exit (EXIT_FAILURE);
+	}
+
+	t1 = gettimeofday_sec ();
+	TRACE (recover, index, -1, (int)emit_seq);
+	recovering = 1;
+	if (-1 == restart_queues (&requeued)) {
+		fprintf (stderr, "restarting the queues failed (%d, %s), relinking\n",
+			 errno, strerror (errno));
+		/* links can't change while either queue is still streaming */
+		xioctl (v4lout_fd, VIDIOC_STREAMOFF, &out_type);
+		xioctl (v4lcap_fd, VIDIOC_STREAMOFF, &cap_type);
+		setup_links ();
+		setup_pads ();
+		relinked = 1;
+		n_relinks++;
+		if (-1 == restart_queues (&requeued))
+			errno_exit ("recovery after relinking for ", ocstring[index]);
+	}
+	recovering = 0;
+	t2 = gettimeofday_sec ();
+
+	n_recoveries++;
+	METRIC_ADD (recoveries, 1);
+	recover_sum += t2 - t1;
+	if (t2 - t1 > recover_max)
+		recover_max = t2 - t1;
+	printf("recovered from %s on %s at frame %u in %.3f ms "
+	       "(%u frame(s) re-queued%s)\n",
+	       why, ocstring[index], emit_seq, (t2 - t1) * 1e3,
+	       requeued, relinked ? ", relinked" : "");
+}
+
+/*
+ * Switch the input to the next format in switches[] without restarting.
+ * Only the OUT queue is stopped unless the UDS has to be linked in or
+ * out, and buffers are only reallocated when the new planes don't fit.
+ */
+static void
+reconfigure                     (void)
+{
+	struct format_switch *sw = &switches[cur_switch++];
+	unsigned int i, old_planes = n_planes[OUT];
+	int relink, realloc_bufs;
+	double t1, t2;
+
+	t1 = gettimeofday_sec();
+	have_hash = 0;
+
+	relink = scaled_from (sw->width, sw->height) != is_scaled ();
+
+	stop_capturing (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	if (relink)
+		stop_capturing (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+	width[OUT] = sw->width;
+	height[OUT] = sw->height;
+	format[OUT] = sw->format;
+	code[OUT] = sw->code;
+
+	/* Drivers refusing S_FMT with buffers allocated (EBUSY) force a realloc. */
+	realloc_bufs = (-1 == set_format (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE));
+	if (realloc_bufs && errno != EBUSY)
+		errno_exit ("VIDIOC_S_FMT for ", dev_name[OUT]);
+
+	if (!realloc_bufs)
+		realloc_bufs = (pix_fmt[OUT].num_planes != old_planes);
+	for (i = 0; !realloc_bufs && i < old_planes; i++)
+		if (pix_fmt[OUT].plane_fmt[i].sizeimage > buffers[OUT][0][i].length)
+			realloc_bufs = 1;
+
+	if (realloc_bufs) {
+		uninit_requests ();
+		uninit_device (OUT);
+		release_buffers (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+		if (-1 == set_format (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE))
+			errno_exit ("VIDIOC_S_FMT for ", dev_name[OUT]);
+		n_planes[OUT] = sw->n_planes;
+		if (io == IO_METHOD_DMABUF)
+			init_dmabuf_queues (OUT, OUT);
+		else
+			init_mmap (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, N_BUFFERS);
+		if (use_requests)
+			init_requests ();
+	} else {
+		reset_requests ();
+	}
+
+	if (relink)
+		setup_links ();
+	setup_pads ();
+
+	/* the pipeline restarts counting frames */
+	if (histo_fd >= 0) {
+		drain_histogram ();
+		if (-1 == restart_histogram ())
+			errno_exit ("restarting ", ocstring[HGO]);
+	}
+
+	queue_buffers (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	if (relink)
+		queue_buffers (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	start_capturing (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	if (relink)
+		start_capturing (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+	t2 = gettimeofday_sec();
+	printf("switched input to %dx%d at frame %u in %.3f ms (%s%s)\n",
+	       width[OUT], height[OUT], sw->frame, (t2 - t1) * 1e3,
+	       realloc_bufs ? "buffers reallocated" : "buffers kept",
+	       relink ? ", relinked" : "");
+}
+
+/*
+ * Apply the -p parameters params_due() held back, on the drained
+ * pipeline. OUT is stopped so that all its buffers are queued again
+ * after the change; a moved crop sets the pads again, and when the
+ * window starts or stops matching the output size the UDS is linked in
+ * or out, which stops CAP too.
+ */
+static void
+apply_due_params                (void)
+{
+	int was_scaled = is_scaled (), moved, relink;
+	double t1, t2;
+
+	t1 = gettimeofday_sec();
+	have_hash = 0;
+
+	stop_capturing (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	moved = apply_frame_params (out_seq, -1);
+	relink = is_scaled () != was_scaled;
+	if (relink)
+		stop_capturing (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	reset_requests ();
+
+	if (relink)
+		setup_links ();
+	if (moved)
+		setup_pads ();
+
+	/* the pipeline restarts counting frames */
+	if (histo_fd >= 0) {
+		drain_histogram ();
+		if (-1 == restart_histogram ())
+			errno_exit ("restarting ", ocstring[HGO]);
+	}
+
+	queue_buffers (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	if (relink)
+		queue_buffers (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	start_capturing (v4lout_fd, OUT, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	if (relink)
+		start_capturing (v4lcap_fd, CAP, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+	t2 = gettimeofday_sec();
+	printf("parameters of frame %u applied in %.3f ms (crop (%d,%d)/%ux%u%s)\n",
+	       params[next_param - 1].frame, (t2 - t1) * 1e3, crop.left, crop.top,
+	       crop.width, crop.height, relink ? ", relinked" : "");
+}
+
+/*
+ * A table file holds 256 (1D LUT) or 17x17x17 (3D CLU) 0xRRGGBB words;
+ * "gamma:<g>" builds a 1D gamma curve instead.
+ */
+static unsigned int
+load_lut                        (const char *name, uint32_t *table)
+{
+	unsigned long v;
+	unsigned int n = 0;
+	double g;
+	char word[32];
+	FILE *fp;
+
+	if (!strncmp (name, "gamma:", 6)) {
+		g = strtod (name + 6, NULL);
+		if (g <= 0.0)
+			return 0;
+		for (n = 0; n < LUT_SIZE; n++) {
+			v = (unsigned long)(pow (n / 255.0, 1.0 / g) * 255.0 + 0.5);
+			table[n] = (v << 16) | (v << 8) | v;
+		}
+		return n;
+	}
+
+	if ((fp = fopen (name, "r")) == NULL)
+		return 0;
+	while (n < CLU_SIZE && fscanf (fp, "%31s", word) == 1) {
+		if (word[0] == '#') {
+			fscanf (fp, "%*[^\n]");
+			continue;
+		}
+		v = strtoul (word, NULL, 0);
+		table[n++] = v & 0xffffff;
+	}
+	fclose (fp);
+
+	return (n == LUT_SIZE || n == CLU_SIZE) ? n : 0;
+}
+
+static int
+upload_lut                      (const uint32_t *table)
+{
+	struct v4l2_ext_controls ctrls;
+	struct v4l2_ext_control ctrl[2];
+
+	CLEAR (ctrls);
+	CLEAR (ctrl);
+	if (lut_entries == CLU_SIZE) {
+		ctrl[0].id = V4L2_CID_VSP1_CLU_MODE;
+		ctrl[0].value = 1;	/* 3D */
+		ctrl[1].id = V4L2_CID_VSP1_CLU_TABLE;
+		ctrl[1].size = CLU_SIZE * sizeof(uint32_t);
+		ctrl[1].p_u32 = (uint32_t *)table;
+		ctrls.count = 2;
+	} else {
+		ctrl[0].id = V4L2_CID_VSP1_LUT_TABLE;
+		ctrl[0].size = LUT_SIZE * sizeof(uint32_t);
+		ctrl[0].p_u32 = (uint32_t *)table;
+		ctrls.count = 1;
+	}
+	ctrls.controls = ctrl;
+
+	return xioctl (v4lsub_fd[LUT], VIDIOC_S_EXT_CTRLS, &ctrls);
+}
+
+static void
+sighup_handler                  (int sig)
+{
+	int saved = errno;
+	ssize_t r;
+
+	(void)sig;
+	r = write (lut_pipe[1], "", 1);	/* fails when a reload is already pending */
+	(void)r;
+	errno = saved;
+}
+
+/*
+ * SIGHUP wakes this thread up through lut_pipe, so the table file is
+ * parsed off the frame loop; the result waits in the back buffer for
+ * swap_lut(). A table of the other kind (LUT vs CLU) would need a
+ * relink and is refused.
+ */
+static void *
+lut_loader                      (void *arg)
+{
+	uint32_t *table;
+	ssize_t n;
+	char c;
+
+	(void)arg;
+	table = malloc (CLU_SIZE * sizeof(uint32_t));
+	if (!table)
+		errno_exit ("cannot allocate a LUT table", NULL);
+
+	for (;;) {
+		n = read (lut_pipe[0], &c, 1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		if (load_lut (lut_source, table) != lut_entries) {
+			fprintf (stderr, "%s: not reloaded\n", lut_source);
+			continue;
+		}
+		pthread_mutex_lock (&lut_lock);
+		memcpy (lut_table[!lut_front], table, lut_entries * sizeof(uint32_t));
+		lut_ready = 1;
+		pthread_mutex_unlock (&lut_lock);
+	}
+	free (table);
+
+	return NULL;
 }
 
-static int
-confirm_link (struct media_entity_desc *src, struct media_entity_desc *sink)
+static void
+init_lut                        (const char *name)
 {
-	struct media_links_enum links;
-	struct media_link_desc link;
-	int pad_index, ret, i;
+	pthread_t thread;
 
-	printf("src.pads = %d, src.links = %d\n", src->pads, src->links);
-	CLEAR (links);
-	links.pads = malloc(sizeof(struct media_pad_desc) * src->pads);
-	links.links = malloc(sizeof(struct media_link_desc) * src->links);
+	lut_table[0] = malloc (CLU_SIZE * sizeof(uint32_t));
+	lut_table[1] = malloc (CLU_SIZE * sizeof(uint32_t));
+	if (!lut_table[0] || !lut_table[1])
+		errno_exit ("cannot allocate LUT tables", NULL);
 
-	links.entity = src->id;
-	ret = ioctl(media_fd, MEDIA_IOC_ENUM_LINKS, &links);
+	lut_entries = load_lut (name, lut_table[0]);
+	if (!lut_entries) {
+		fprintf (stderr, "%s: need %d or %d entries\n", name, LUT_SIZE, CLU_SIZE);
+		exit (EXIT_FAILURE);
+	}
+	lut_source = strdup (name);
+	entity_name[LUT] = (lut_entries == CLU_SIZE) ? "clu" : "lut";
+
+	if (-1 == pipe (lut_pipe))
+		errno_exit ("pipe for the LUT loader", NULL);
+	fcntl (lut_pipe[1], F_SETFL, O_NONBLOCK);
+	if (pthread_create (&thread, NULL, lut_loader, NULL))
+		errno_exit ("pthread_create for the LUT loader", NULL);
+	pthread_detach (thread);
+	signal (SIGHUP, sighup_handler);
+}
 
-	/* find a link to the sink entity */
-	for (i=0; i<src->links; i++) {
-		pad_index = links.links[i].source.index;
-		printf("pad_index = %d, links.links[%d].sink.entity = %d\n",
-		       pad_index, i, links.links[i].sink.entity);
-		if ((links.pads[pad_index].flags & MEDIA_PAD_FL_SOURCE) &&
-		    (links.links[i].sink.entity == sink->id)) {
-			printf("A link from entity-%d to entity-%d is %s!\n",
-			       src->id, sink->id,
-			       (links.links[i].flags & MEDIA_LNK_FL_ENABLED) ? "ENABLED" : "DISABLED");
-			return ((links.links[i].flags & MEDIA_LNK_FL_ENABLED) == 0);
-		}
+/*
+ * A table lut_loader() has finished is swapped in between two frames;
+ * the driver applies it from the next frame on, CPU jobs from the next
+ * one queued.
+ */
+static void
+swap_lut                        (void)
+{
+	int back;
+
+	pthread_mutex_lock (&lut_lock);
+	if (!lut_ready) {
+		pthread_mutex_unlock (&lut_lock);
+		return;
 	}
+	lut_ready = 0;
+	back = !lut_front;
+	if (!sw_device && -1 == upload_lut (lut_table[back])) {
+		pthread_mutex_unlock (&lut_lock);
+		fprintf (stderr, "cannot upload %s: %d, %s\n",
+			 lut_source, errno, strerror (errno));
+		return;
+	}
+	lut_front = back;
+	pthread_mutex_unlock (&lut_lock);
 
-	printf("Link from entity-%d to entity-%d! not found.\n", src->id, sink->id);
-	return -1;
+	have_hash = 0;		/* the next frame looks different */
+	printf("%s reloaded at frame %u\n", lut_source, out_seq);
 }
 
 static void list_formats(int fd, int index, enum v4l2_buf_type buftype)
@@ -814,17 +4565,44 @@ usage                           (FILE *                 fp,
                  "-h | --help               Print this message\n"
                  "-d | --input_device name  Video device name for input [/dev/video0]\n"
                  "-D | --output_device name Video device name for output [/dev/video1]\n"
-                 "-c | --input_color \n"
+                 "-c | --input_color name   Also P010, repacked to NV12 as it is read\n"
                  "-C | --output_color \n"
                  "-s | --input_size \n"
                  "-S | --output_size \n"
                  "-f | --input_file name    Specify a file to input\n"
                  "-F | --output_file name   Specify a file to output\n"
+                 "-p | --params name        Per-frame crop/alpha: <frame> <l> <t> <w> <h> [<alpha>]\n"
+                 "-r | --request            Attach per-frame alpha with media requests (not on vsp1 m2m nodes)\n"
+                 "-w | --switch f:size[:color] Switch the input format at frame f\n"
+                 "-j | --cpu-workers n      Offload frames to n CPU threads when the VSP is late\n"
+                 "-b | --budget ms          Per-frame latency budget for offloading [33]\n"
+                 "-n | --count n            Number of frames to convert [100]\n"
+                 "-x | --sw                 Use the software converter instead of the VSP\n"
+                 "-B | --bench name         Sweep all sizes and colors, results to name (.csv/.json)\n"
+                 "-g | --regress name[:tol] Record (new file, golden frames in name.d/) or verify output, fps and latency of the sweep\n"
+                 "-m | --shard [rr:]N|auto  Split the frames over N (or all) VSP instances\n"
+                 "-y | --histogram name     Write the HGO histogram of each frame to name\n"
+                 "-M | --pool MiB           DMABUF buffers from a dma-heap pool within MiB (0: no limit)\n"
+                 "-a | --affinity cpus      Pin the streaming thread, e.g. 2 or 2-3,5\n"
+                 "-A | --worker-affinity cpus Pin the CPU workers\n"
+                 "-P | --sched policy       other[:nice] | fifo:prio | rr:prio | deadline:runtime_us:period_us\n"
+                 "-L | --mlock              Lock all memory and prefault the stacks\n"
+                 "-o | --direct             Bypass the page cache (O_DIRECT) for -f/-F\n"
+                 "-R | --readahead KB       Read ahead/drop behind window for -f/-F\n"
+                 "-T | --trace              Write QBUF/DQBUF/I/O events to the ftrace marker\n"
+                 "-u | --lut name|gamma:g   Apply a 1D LUT or 3D CLU table in the VSP, SIGHUP reloads\n"
+                 "-e | --dedup              Repeat the last output for identical input frames\n"
+                 "-k | --metrics name       Live counters in /dev/shm/vsp-name and Prometheus on @vsp-name (vspstat)\n"
+                 "-z | --delta              Write -F as frame deltas with run lengths (vsp-delta-decode)\n"
+                 "-l | --live fps           Pace input at fps, drop frames that would miss the -b deadline\n"
+                 "-t | --rotate 0|90|180|270 Rotate the output clockwise\n"
+                 "-H | --hflip              Mirror the output horizontally\n"
+                 "-V | --vflip              Flip the output vertically\n"
                  "",
                  argv[0]);
 }
 
-static const char short_options [] = "hc:C:d:D:f:F:s:S:";
+static const char short_options [] = "a:A:hb:B:c:C:d:D:ef:F:g:Hj:k:l:Lm:M:n:op:P:rR:s:S:t:Tu:Vw:xy:z";
 
 static const struct option
 long_options [] = {
@@ -835,6 +4613,33 @@ long_options [] = {
         { "outout_device",     required_argument,      NULL,           'D' },
         { "input_file",      required_argument,      NULL,           'f' },
         { "output_file",     required_argument,      NULL,           'F' },
+        { "params",          required_argument,      NULL,           'p' },
+        { "request",         no_argument,            NULL,           'r' },
+        { "switch",          required_argument,      NULL,           'w' },
+        { "cpu-workers",     required_argument,      NULL,           'j' },
+        { "budget",          required_argument,      NULL,           'b' },
+        { "count",           required_argument,      NULL,           'n' },
+        { "sw",              no_argument,            NULL,           'x' },
+        { "bench",           required_argument,      NULL,           'B' },
+        { "regress",         required_argument,      NULL,           'g' },
+        { "shard",           required_argument,      NULL,           'm' },
+        { "histogram",       required_argument,      NULL,           'y' },
+        { "pool",            required_argument,      NULL,           'M' },
+        { "affinity",        required_argument,      NULL,           'a' },
+        { "worker-affinity", required_argument,      NULL,           'A' },
+        { "sched",           required_argument,      NULL,           'P' },
+        { "mlock",           no_argument,            NULL,           'L' },
+        { "direct",          no_argument,            NULL,           'o' },
+        { "readahead",       required_argument,      NULL,           'R' },
+        { "trace",           no_argument,            NULL,           'T' },
+        { "lut",             required_argument,      NULL,           'u' },
+        { "dedup",           no_argument,            NULL,           'e' },
+        { "delta",           no_argument,            NULL,           'z' },
+        { "metrics",         required_argument,      NULL,           'k' },
+        { "live",            required_argument,      NULL,           'l' },
+        { "rotate",          required_argument,      NULL,           't' },
+        { "hflip",           no_argument,            NULL,           'H' },
+        { "vflip",           no_argument,            NULL,           'V' },
         { "input_size",     required_argument,      NULL,           's' },
         { "outout_size",     required_argument,      NULL,           'S' },
         { 0, 0, 0, 0 }
@@ -860,100 +4665,1125 @@ static const struct sizes_t sizes[] = {
 	{ "1080p", 1920, 1080 },
 };
 
-static int set_size (char * arg, int * w, int * h)
+static int set_size (char * arg, int * w, int * h)
+{
+	int nr_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	int i;
+
+	if (!arg)
+		return -1;
+
+	for (i=0; i<nr_sizes; i++) {
+		if (!strcasecmp (arg, sizes[i].name)) {
+			*w = sizes[i].w;
+			*h = sizes[i].h;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static const char * show_size (int w, int h)
+{
+	int nr_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	int i;
+
+	for (i=0; i<nr_sizes; i++) {
+		if (w == sizes[i].w && h == sizes[i].h)
+			return sizes[i].name;
+	}
+
+	return "";
+}
+
+struct extensions_t {
+	const char *ext;
+	uint32_t fourcc;
+	enum v4l2_mbus_pixelcode code;
+	int n_planes;
+};
+
+static const struct extensions_t exts[] = {
+	{ "RGB565",   V4L2_PIX_FMT_RGB565, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "rgb",      V4L2_PIX_FMT_RGB565, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "RGB888",   V4L2_PIX_FMT_RGB24, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "888",      V4L2_PIX_FMT_RGB24, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "BGR888",   V4L2_PIX_FMT_BGR24, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "RGBx888",  V4L2_PIX_FMT_RGB32, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "x888",     V4L2_PIX_FMT_RGB32, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
+	{ "YV12",     V4L2_PIX_FMT_YVU420M, V4L2_MBUS_FMT_AYUV8_1X32, 3 },
+	{ "I420",     V4L2_PIX_FMT_YUV420M, V4L2_MBUS_FMT_AYUV8_1X32, 3 },
+	{ "NV12",     V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
+	{ "420",      V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
+	{ "yuv",      V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
+	{ "NV21",     V4L2_PIX_FMT_NV21M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
+	{ "NV16",     V4L2_PIX_FMT_NV16M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
+	{ "UYVY",     V4L2_PIX_FMT_UYVY, V4L2_MBUS_FMT_AYUV8_1X32, 1 },
+	{ "YUYV",     V4L2_PIX_FMT_YUYV, V4L2_MBUS_FMT_AYUV8_1X32, 1 },
+	{ "YVYU",     V4L2_PIX_FMT_YVYU, V4L2_MBUS_FMT_AYUV8_1X32, 1 },
+};
+
+static int set_colorspace (char * arg, uint32_t * fourcc, enum v4l2_mbus_pixelcode *code, int *n_planes)
+{
+	int nr_exts = sizeof(exts) / sizeof(exts[0]);
+	int i;
+
+	if (!arg)
+		return -1;
+
+	for (i=0; i<nr_exts; i++) {
+		if (!strcasecmp (arg, exts[i].ext)) {
+			*fourcc = exts[i].fourcc;
+			*code = exts[i].code;
+			*n_planes = exts[i].n_planes;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static const char * show_colorspace (uint32_t c)
+{
+	int nr_exts = sizeof(exts) / sizeof(exts[0]);
+	int i;
+
+	for (i=0; i<nr_exts; i++) {
+		if (c == exts[i].fourcc)
+			return exts[i].ext;
+	}
+
+	return "<Unknown colorspace>";
+}
+
+struct sched_attr_dl {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t  sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+};
+
+/*
+ * Pin, lock and raise the streaming thread before the first frame. CPU
+ * workers created later inherit a FIFO/RR policy; their CPUs are set in
+ * init_cpu_path(). A SCHED_DEADLINE task can't fork or create threads,
+ * so that policy is only entered by enter_deadline() right before the
+ * frame loop, once everything is spawned.
+ */
+static void
+setup_realtime                  (void)
+{
+	struct sched_param sp;
+
+	if (main_pinned &&
+	    -1 == sched_setaffinity (0, sizeof(main_cpus), &main_cpus))
+		errno_exit ("sched_setaffinity", NULL);
+
+	if (lock_memory) {
+		if (-1 == mlockall (MCL_CURRENT | MCL_FUTURE))
+			errno_exit ("mlockall", NULL);
+		prefault_stack ();
+	}
+
+	switch (sched_policy) {
+	case SCHED_OTHER:
+		/* threads created from here on inherit it */
+		if (nice_value && -1 == setpriority (PRIO_PROCESS, 0, nice_value))
+			errno_exit ("setpriority", NULL);
+		break;
+
+	case SCHED_DEADLINE:
+		break;
+
+	default:
+		CLEAR (sp);
+		sp.sched_priority = sched_prio;
+		if (-1 == sched_setscheduler (0, sched_policy, &sp))
+			errno_exit ("sched_setscheduler", NULL);
+		break;
+	}
+}
+
+/*
+ * Move the streaming thread (only) to SCHED_DEADLINE. RESET_ON_FORK
+ * keeps any later fork or thread creation from failing with EAGAIN; the
+ * children just run SCHED_OTHER.
+ */
+static void
+enter_deadline                  (void)
+{
+	struct sched_attr_dl attr;
+
+	if (sched_policy != SCHED_DEADLINE)
+		return;
+
+	CLEAR (attr);
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_flags = SCHED_FLAG_RESET_ON_FORK;
+	attr.sched_runtime = dl_runtime;
+	attr.sched_deadline = dl_period;
+	attr.sched_period = dl_period;
+	if (-1 == syscall (SYS_sched_setattr, 0, &attr, 0))
+		errno_exit ("sched_setattr(SCHED_DEADLINE)", NULL);
+}
+
+static void
+report_realtime                 (void)
+{
+	double avg, dev;
+	unsigned int i, n;
+
+	if (wake_n) {
+		for (i = 0, n = 0; i < WAKE_BUCKETS - 1 && n < wake_n * 0.99; i++)
+			n += wake_hist[i];
+		printf("wakeup latency: %u timed wakeups, avg %.1f p99 <%u max %.1f us\n",
+		       wake_n, wake_sum / wake_n * 1e6, i * 10, wake_max * 1e6);
+	} else {
+		printf("wakeup latency: no timed wakeups (pace the input with --live)\n");
+	}
+
+	if (!ival_n)
+		return;
+
+	avg = ival_sum / ival_n;
+	dev = ival_sum2 / ival_n - avg * avg;
+	dev = (dev > 0.0) ? sqrt (dev) : 0.0;
+	printf("frame interval (incl. conversion): min %.3f avg %.3f max %.3f stddev %.3f ms, "
+	       "%u of %u over the %.1f ms budget\n",
+	       ival_min * 1e3, avg * 1e3, ival_max * 1e3, dev * 1e3,
+	       ival_late, ival_n, latency_budget * 1e3);
+}
+
+static int
+parse_cpus                      (char *arg, cpu_set_t *set)
+{
+	char *tok, *end;
+	long a, b;
+
+	CPU_ZERO (set);
+	for (tok = strtok (arg, ","); tok; tok = strtok (NULL, ",")) {
+		a = b = strtol (tok, &end, 10);
+		if (*end == '-')
+			b = strtol (end + 1, &end, 10);
+		if (*end || a < 0 || b < a || b >= CPU_SETSIZE)
+			return -1;
+		for (; a <= b; a++)
+			CPU_SET (a, set);
+	}
+
+	return 0;
+}
+
+/* other[:nice] | fifo:prio | rr:prio | deadline:runtime_us:period_us */
+static int
+parse_sched                     (char *arg)
+{
+	char *opt = strchr (arg, ':');
+	unsigned long rt, period;
+
+	if (opt)
+		*opt++ = '\0';
+
+	if (!strcmp (arg, "other")) {
+		sched_policy = SCHED_OTHER;
+		nice_value = opt ? atoi (opt) : 0;
+		if (nice_value < -20 || nice_value > 19)
+			return -1;
+	} else if (!strcmp (arg, "fifo") || !strcmp (arg, "rr")) {
+		sched_policy = (arg[0] == 'f') ? SCHED_FIFO : SCHED_RR;
+		sched_prio = opt ? atoi (opt) : sched_get_priority_min (sched_policy);
+	} else if (!strcmp (arg, "deadline")) {
+		if (!opt || sscanf (opt, "%lu:%lu", &rt, &period) != 2 || rt > period)
+			return -1;
+		sched_policy = SCHED_DEADLINE;
+		dl_runtime = rt * 1000ULL;
+		dl_period = period * 1000ULL;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+static double
+rusage_sec                      (struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec * 1e-6 +
+	       ru->ru_stime.tv_sec + ru->ru_stime.tv_usec * 1e-6;
+}
+
+static void
+setup_phase                     (const char *name)
+{
+	if (n_phases < MAX_PHASES) {
+		phases[n_phases].name = name;
+		phases[n_phases].t = gettimeofday_sec ();
+		n_phases++;
+	}
+}
+
+static void
+report_setup                    (void)
+{
+	unsigned int i;
+
+	printf("setup %.3f ms:", t_setup * 1e3);
+	for (i = 1; i < n_phases; i++)
+		printf(" %s %.3f", phases[i].name,
+		       (phases[i].t - phases[i - 1].t) * 1e3);
+	printf(" (init OUT %.3f CAP %.3f in parallel)\n",
+	       t_init[OUT] * 1e3, t_init[CAP] * 1e3);
+}
+
+static void *
+init_thread                     (void *arg)
+{
+	int index = (int)(intptr_t)arg;
+	double t = gettimeofday_sec ();
+
+	if (index == OUT)
+		init_device (v4lout_fd, OUT,
+			     V4L2_CAP_VIDEO_OUTPUT_MPLANE,
+			     V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+	else
+		init_device (v4lcap_fd, CAP,
+			     V4L2_CAP_VIDEO_CAPTURE_MPLANE,
+			     V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	t_init[index] = gettimeofday_sec () - t;
+
+	return NULL;
+}
+
+static void
+run_pipeline                    (void)
+{
+	struct rusage ru0, ru1;
+	pthread_t init_threads[2];
+	int ret, i;
+	char tmp[256];
+
+	t_setup = gettimeofday_sec ();
+	setup_phase ("start");
+
+        v4lout_fd = open_device (dev_name[OUT]);
+        v4lcap_fd = open_device (dev_name[CAP]);
+	setup_phase ("open");
+
+	for (i = OUT; i <= CAP; i++)
+		if (pthread_create (&init_threads[i], NULL, init_thread, (void *)(intptr_t)i))
+			errno_exit ("pthread_create for init_device", NULL);
+
+	pthread_mutex_lock (&init_lock);
+	while (n_probed < 2)
+		pthread_cond_wait (&init_cond, &init_lock);
+	pthread_mutex_unlock (&init_lock);
+	setup_phase ("probe");
+
+	media_fd = open_media_device (ip_name);
+	if (media_fd < 0)
+		errno_exit ("cannot open a media file for ", ip_name);
+
+	sprintf(tmp, "%s %s", ip_name, entity_name[OUT]);
+	ret = get_media_entity (tmp, &entity[OUT]);
+	printf("ret = %d, entity[OUT] = %s\n", ret, entity[OUT].name);
+	sprintf(tmp, "%s %s", ip_name, entity_name[CAP]);
+	ret = get_media_entity (tmp, &entity[CAP]);
+	printf("ret = %d, entity[CAP] = %s\n", ret, entity[CAP].name);
+	setup_phase ("media");
+
+	for (i = OUT; i <= CAP; i++)
+		pthread_join (init_threads[i], NULL);
+	if (io == IO_METHOD_DMABUF)
+		init_dmabuf_queues (OUT, CAP);
+	setup_phase ("buffers");
+
+	/* parameters of frame 0 go in with the first setup */
+	if (n_params)
+		apply_frame_params (0, -1);
+	setup_links ();
+	setup_phase ("links");
+
+	if (use_requests)
+		init_requests ();
+
+	setup_pads ();
+
+	if (lut_entries && -1 == upload_lut (lut_table[lut_front]))
+		errno_exit ("cannot upload ", lut_source);
+	if (histo_name)
+		init_histogram ();
+	setup_phase ("pads");
+
+        queue_buffers (v4lout_fd, OUT,
+		       V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+        queue_buffers (v4lcap_fd, CAP,
+		       V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	setup_phase ("queue");
+	if (histo_fd >= 0)
+		start_histogram ();
+        start_capturing (v4lout_fd, OUT,
+			 V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+        start_capturing (v4lcap_fd, CAP,
+			 V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+	setup_phase ("streamon");
+
+	if (n_workers)
+		init_cpu_path ();
+	setup_phase ("workers");
+
+	t_setup = gettimeofday_sec () - t_setup;
+	report_setup ();
+
+	getrusage (RUSAGE_SELF, &ru0);
+	enter_deadline ();
+        mainloop ();
+	getrusage (RUSAGE_SELF, &ru1);
+	cpu_time = rusage_sec (&ru1) - rusage_sec (&ru0);
+
+	if (rt_report)
+		report_realtime ();
+	if (live_fps > 0.0)
+		report_live ();
+	if (dedup)
+		printf("%u of %u frames were duplicates and skipped the conversion\n",
+		       n_dups, emit_seq);
+	if (t_first > 0.0)
+		printf("time to first frame %.3f ms\n",
+		       (t_first - phases[0].t) * 1e3);
+	if (n_recoveries)
+		printf("%u recoveries (%u relinked), avg %.3f max %.3f ms\n",
+		       n_recoveries, n_relinks,
+		       recover_sum / n_recoveries * 1e3, recover_max * 1e3);
+
+	if (n_workers)
+		uninit_cpu_path ();
+	if (histo_fd >= 0)
+		uninit_histogram ();
+
+        stop_capturing (v4lout_fd, OUT,
+			V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+        stop_capturing (v4lcap_fd, CAP,
+			V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+	uninit_requests ();
+        uninit_device (OUT);
+        uninit_device (CAP);
+	if (io == IO_METHOD_DMABUF)
+		pool_report ();
+
+        close_device (v4lout_fd, OUT);
+        close_device (v4lcap_fd, CAP);
+}
+
+/* the same frame loop with sw_convert() standing in for the VSP */
+static void
+run_sw                          (void)
+{
+	uint8_t *src[VIDEO_MAX_PLANES], *dst[VIDEO_MAX_PLANES];
+	uint32_t *scratch;
+	struct rusage ru0, ru1;
+	double t;
+
+	t_setup = gettimeofday_sec ();
+
+	if (sw_fill_format (&pix_fmt[OUT], width[OUT], height[OUT], format[OUT]) < 0 ||
+	    sw_fill_format (&pix_fmt[CAP], width[CAP], height[CAP], format[CAP]) < 0) {
+		fprintf (stderr, "format not supported by the software device\n");
+		exit (EXIT_FAILURE);
+	}
+	if (orient_requested () && !orient_bpp (format[CAP])) {
+		fprintf (stderr, "the software device only rotates/flips packed RGB\n");
+		exit (EXIT_FAILURE);
+	}
+	src[0] = calloc (1, frame_size (&pix_fmt[OUT], NULL, NULL));
+	dst[0] = calloc (1, frame_size (&pix_fmt[CAP], NULL, NULL));
+	scratch = malloc ((width[OUT] + width[CAP]) * sizeof(uint32_t));
+	if (!src[0] || !dst[0] || !scratch)
+		errno_exit ("cannot allocate the software device", NULL);
+	frame_size (&pix_fmt[OUT], src[0], src);
+	frame_size (&pix_fmt[CAP], dst[0], dst);
+
+	t_setup = gettimeofday_sec () - t_setup;
+
+	getrusage (RUSAGE_SELF, &ru0);
+	enter_deadline ();
+	while (emit_seq + live_drops < frame_count) {
+		if (lut_entries)
+			swap_lut ();
+		if (read_input (src, &pix_fmt[OUT])) {
+			repeat_frame (out_seq++);
+			continue;
+		}
+		out_seq++;
+		t = gettimeofday_sec ();
+		sw_convert (&pix_fmt[OUT], src, &pix_fmt[CAP], dst, scratch,
+			    lut_entries ? lut_table[lut_front] : NULL);
+		t = gettimeofday_sec () - t;
+		log_latency (t);
+		METRIC_ADD (frames_cpu, 1);
+		METRIC_ADD (convert_ns, t * 1e9);
+		write_frame (dst, &pix_fmt[CAP], 1);
+		frame_emitted ();
+	}
+	getrusage (RUSAGE_SELF, &ru1);
+	cpu_time = rusage_sec (&ru1) - rusage_sec (&ru0);
+
+	if (rt_report)
+		report_realtime ();
+	if (live_fps > 0.0)
+		report_live ();
+	if (dedup)
+		printf("%u of %u frames were duplicates and skipped the conversion\n",
+		       n_dups, emit_seq);
+
+	free (src[0]);
+	free (dst[0]);
+	free (scratch);
+}
+
+struct bench_result {
+	int ok;
+	double setup;
+	double fps;
+	double lat[4];		/* p50, p90, p99, max */
+	double cpu;		/* per frame */
+	uint64_t hash;		/* --regress: all output */
+	struct v4l2_pix_format_mplane fmt;	/* as the output was written */
+};
+
+struct bench_desc {
+	const char *in_size;
+	const char *in_ext;
+	const char *out_ext;
+	int win, hin, wout, hout;
+	uint32_t fin, fout;
+	int scaled;
+};
+
+static int
+cmp_double                      (const void *a, const void *b)
 {
-	int nr_sizes = sizeof(sizes) / sizeof(sizes[0]);
-	int i;
+	double x = *(const double *)a, y = *(const double *)b;
 
-	if (!arg)
-		return -1;
+	return (x > y) - (x < y);
+}
 
-	for (i=0; i<nr_sizes; i++) {
-		if (!strcasecmp (arg, sizes[i].name)) {
-			*w = sizes[i].w;
-			*h = sizes[i].h;
-			return 0;
+/*
+ * RMS difference between the output in 'name' and the golden output in
+ * 'golden', over every sample of every frame, per plane; returns the
+ * worst plane. RGB565 is split into its fields scaled to 8 bits, the
+ * other formats have byte samples. Row padding is skipped. Returns -1 if
+ * the golden output is missing or has another number of frames.
+ */
+static double
+golden_rms                      (const char *name, const char *golden,
+				 const struct v4l2_pix_format_mplane *f)
+{
+	struct v4l2_pix_format_mplane tight;
+	uint8_t *a[VIDEO_MAX_PLANES], *b[VIDEO_MAX_PLANES];
+	double sum[VIDEO_MAX_PLANES] = { 0.0 }, n[VIDEO_MAX_PLANES] = { 0.0 };
+	double d, rms, worst = 0.0;
+	size_t len = frame_size (f, NULL, NULL), row;
+	unsigned int i, r, c, k, rows, va, vb;
+	struct stat sa, sb;
+	off_t off;
+	int fa, fb;
+
+	fa = open (name, O_RDONLY);
+	fb = open (golden, O_RDONLY);
+	if (fa < 0 || fb < 0 || fstat (fa, &sa) < 0 || fstat (fb, &sb) < 0 ||
+	    !len || sa.st_size != sb.st_size || sa.st_size % len) {
+		if (fa >= 0)
+			close (fa);
+		if (fb >= 0)
+			close (fb);
+		return -1.0;
+	}
+	if (sw_fill_format (&tight, f->width, f->height, f->pixelformat) < 0)
+		tight = *f;
+
+	a[0] = malloc (len);
+	b[0] = malloc (len);
+	if (!a[0] || !b[0])
+		errno_exit ("cannot allocate the golden frames", NULL);
+	frame_size (f, a[0], a);
+	frame_size (f, b[0], b);
+
+	for (off = 0; off < sa.st_size; off += len) {
+		if (pread (fa, a[0], len, off) != (ssize_t)len ||
+		    pread (fb, b[0], len, off) != (ssize_t)len)
+			errno_exit ("read for golden output ", name);
+		for (i = 0; i < f->num_planes; i++) {
+			rows = f->plane_fmt[i].sizeimage / f->plane_fmt[i].bytesperline;
+			row = tight.plane_fmt[i].bytesperline;
+			for (r = 0; r < rows; r++) {
+				const uint8_t *x = a[i] + r * f->plane_fmt[i].bytesperline;
+				const uint8_t *y = b[i] + r * f->plane_fmt[i].bytesperline;
+
+				if (f->pixelformat != V4L2_PIX_FMT_RGB565) {
+					for (c = 0; c < row; c++) {
+						d = (double)x[c] - y[c];
+						sum[i] += d * d;
+					}
+					n[i] += row;
+					continue;
+				}
+				for (c = 0; c + 1 < row; c += 2) {
+					va = x[c] | x[c + 1] << 8;
+					vb = y[c] | y[c + 1] << 8;
+					for (k = 0; k < 3; k++) {
+						/* 5 bits of red, 6 of green, 5 of blue */
+						static const unsigned int shift[3] = { 11, 5, 0 };
+						static const unsigned int mask[3] = { 31, 63, 31 };
+
+						d = ((double)((va >> shift[k]) & mask[k]) -
+						     ((vb >> shift[k]) & mask[k])) * 255.0 / mask[k];
+						sum[i] += d * d;
+					}
+					n[i] += 3;
+				}
+			}
 		}
 	}
 
-	return -1;
+	for (i = 0; i < f->num_planes; i++) {
+		rms = n[i] ? sqrt (sum[i] / n[i]) : 0.0;
+		if (rms > worst)
+			worst = rms;
+	}
+	free (a[0]);
+	free (b[0]);
+	close (fa);
+	close (fb);
+
+	return worst;
 }
 
-static const char * show_size (int w, int h)
+/*
+ * Run one case in a child so that a failing combination can't stop the
+ * sweep. The output goes to 'output' when it is not NULL.
+ */
+static void
+bench_case                      (const struct bench_desc *c, struct bench_result *res,
+				 const char *output)
 {
-	int nr_sizes = sizeof(sizes) / sizeof(sizes[0]);
-	int i;
+	static const double pct[4] = { 0.50, 0.90, 0.99, 1.0 };
+	int pfd[2], status, i, null_fd;
+	pid_t pid;
+
+	CLEAR (*res);
+	if (-1 == pipe (pfd))
+		errno_exit ("pipe for bench", NULL);
+
+	fflush (stdout);
+	pid = fork ();
+	if (pid < 0)
+		errno_exit ("fork for bench", NULL);
+
+	if (pid == 0) {
+		close (pfd[0]);
+		null_fd = open ("/dev/null", O_WRONLY);
+		dup2 (null_fd, STDOUT_FILENO);
+
+		width[OUT] = c->win;
+		height[OUT] = c->hin;
+		set_colorspace ((char *)show_colorspace (c->fin), &format[OUT], &code[OUT], (int *)&n_planes[OUT]);
+		width[CAP] = c->wout;
+		height[CAP] = c->hout;
+		set_colorspace ((char *)show_colorspace (c->fout), &format[CAP], &code[CAP], (int *)&n_planes[CAP]);
+		input_fd = output_fd = -1;
+		if (output) {
+			unlink (output);
+			output_fd = open_stream (&out_stream, output, 1);
+		}
 
-	for (i=0; i<nr_sizes; i++) {
-		if (w == sizes[i].w && h == sizes[i].h)
-			return sizes[i].name;
+		lat_max = frame_count + VIDEO_MAX_FRAME;
+		lat_log = calloc (lat_max, sizeof(double));
+
+		if (sw_device)
+			run_sw ();
+		else
+			run_pipeline ();
+
+		qsort (lat_log, lat_n, sizeof(double), cmp_double);
+		res->ok = 1;
+		res->setup = t_setup;
+		if (emit_seq > WARMUP_FRAMES && t_last > t_steady)
+			res->fps = (emit_seq - WARMUP_FRAMES) / (t_last - t_steady);
+		for (i = 0; lat_n && i < 4; i++)
+			res->lat[i] = lat_log[(int)((lat_n - 1) * pct[i])];
+		res->cpu = emit_seq ? cpu_time / emit_seq : 0.0;
+		res->hash = out_hash;
+		res->fmt = pix_fmt[CAP];
+		close_stream (&out_stream, "output");
+		if (write (pfd[1], res, sizeof(*res)) != sizeof(*res))
+			_exit (EXIT_FAILURE);
+		_exit (EXIT_SUCCESS);
 	}
 
-	return "";
+	close (pfd[1]);
+	if (read (pfd[0], res, sizeof(*res)) != sizeof(*res))
+		res->ok = 0;
+	close (pfd[0]);
+	waitpid (pid, &status, 0);
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+		res->ok = 0;
 }
 
-struct extensions_t {
-	const char *ext;
-	uint32_t fourcc;
-	enum v4l2_mbus_pixelcode code;
-	int n_planes;
-};
+/*
+ * sizes[] x exts[] (each fourcc once), each case once at the same size
+ * and once scaled by the UDS to the -S size.
+ */
+static int
+bench_cases                     (struct bench_desc **cases)
+{
+	int nr_sizes = sizeof(sizes) / sizeof(sizes[0]);
+	int nr_exts = sizeof(exts) / sizeof(exts[0]);
+	int i, j, k, l, scaled, n = 0;
+	struct bench_desc *c;
+
+	*cases = calloc (nr_sizes * nr_exts * nr_exts * 2, sizeof(**cases));
+	if (!*cases)
+		errno_exit ("cannot allocate bench cases", NULL);
+
+	for (i = 0; i < nr_sizes; i++)
+	for (j = 0; j < nr_exts; j++)
+	for (k = 0; k < nr_exts; k++)
+	for (scaled = 0; scaled < 2; scaled++) {
+		int wout = scaled ? width[CAP] : sizes[i].w;
+		int hout = scaled ? height[CAP] : sizes[i].h;
+
+		/* each fourcc once */
+		for (l = 0; l < j && exts[l].fourcc != exts[j].fourcc; l++)
+			;
+		if (l < j)
+			continue;
+		for (l = 0; l < k && exts[l].fourcc != exts[k].fourcc; l++)
+			;
+		if (l < k)
+			continue;
+		if (scaled && wout == sizes[i].w && hout == sizes[i].h)
+			continue;
+
+		c = &(*cases)[n++];
+		c->in_size = sizes[i].name;
+		c->in_ext = exts[j].ext;
+		c->out_ext = exts[k].ext;
+		c->win = sizes[i].w;
+		c->hin = sizes[i].h;
+		c->fin = exts[j].fourcc;
+		c->wout = wout;
+		c->hout = hout;
+		c->fout = exts[k].fourcc;
+		c->scaled = scaled;
+	}
 
-static const struct extensions_t exts[] = {
-	{ "RGB565",   V4L2_PIX_FMT_RGB565, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "rgb",      V4L2_PIX_FMT_RGB565, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "RGB888",   V4L2_PIX_FMT_RGB24, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "888",      V4L2_PIX_FMT_RGB24, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "BGR888",   V4L2_PIX_FMT_BGR24, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "RGBx888",  V4L2_PIX_FMT_RGB32, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "x888",     V4L2_PIX_FMT_RGB32, V4L2_MBUS_FMT_ARGB8888_1X32, 1 },
-	{ "YV12",     V4L2_PIX_FMT_YUV420M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
-	{ "NV12",     V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
-	{ "420",      V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
-	{ "yuv",      V4L2_PIX_FMT_NV12M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
-	{ "NV16",     V4L2_PIX_FMT_NV16M, V4L2_MBUS_FMT_AYUV8_1X32, 2 },
-	{ "UYVY",     V4L2_PIX_FMT_UYVY, V4L2_MBUS_FMT_AYUV8_1X32, 1 },
-};
+	return n;
+}
 
-static int set_colorspace (char * arg, uint32_t * fourcc, enum v4l2_mbus_pixelcode *code, int *n_planes)
+/* Results go to 'name' as JSON if it ends in .json, as CSV otherwise. */
+static void
+run_bench                       (const char *name)
 {
-	int nr_exts = sizeof(exts) / sizeof(exts[0]);
-	int i;
+	struct bench_desc *cases, *c;
+	int i, n, json, first = 1;
+	struct bench_result r;
+	FILE *fp;
 
-	if (!arg)
-		return -1;
+	json = strlen (name) > 5 && !strcmp (name + strlen (name) - 5, ".json");
+	if ((fp = fopen (name, "w")) == NULL)
+		errno_exit ("cannot open ", name);
 
-	for (i=0; i<nr_exts; i++) {
-		if (!strcasecmp (arg, exts[i].ext)) {
-			*fourcc = exts[i].fourcc;
-			*code = exts[i].code;
-			*n_planes = exts[i].n_planes;
-			return 0;
+	if (json)
+		fprintf (fp, "[\n");
+	else
+		fprintf (fp, "in_size,in_w,in_h,in_fmt,out_size,out_w,out_h,out_fmt,uds,ok,"
+			 "setup_ms,fps,lat_p50_ms,lat_p90_ms,lat_p99_ms,lat_max_ms,cpu_ms_per_frame\n");
+
+	n = bench_cases (&cases);
+	for (i = 0; i < n; i++) {
+		c = &cases[i];
+		bench_case (c, &r, NULL);
+
+		printf("%-5s %-7s -> %-5s %-7s %s: %s %.1f fps\n",
+		       c->in_size, c->in_ext, show_size (c->wout, c->hout),
+		       c->out_ext, c->scaled ? "uds" : "   ",
+		       r.ok ? "ok    " : "FAILED", r.fps);
+
+		if (json)
+			fprintf (fp, "%s  { \"in_size\": \"%s\", \"in_w\": %d, \"in_h\": %d, "
+				 "\"in_fmt\": \"%s\", \"out_size\": \"%s\", \"out_w\": %d, "
+				 "\"out_h\": %d, \"out_fmt\": \"%s\", \"uds\": %s, \"ok\": %s, "
+				 "\"setup_ms\": %.3f, \"fps\": %.2f, \"lat_p50_ms\": %.3f, "
+				 "\"lat_p90_ms\": %.3f, \"lat_p99_ms\": %.3f, \"lat_max_ms\": %.3f, "
+				 "\"cpu_ms_per_frame\": %.3f }",
+				 first ? "" : ",\n",
+				 c->in_size, c->win, c->hin, c->in_ext,
+				 show_size (c->wout, c->hout), c->wout, c->hout, c->out_ext,
+				 c->scaled ? "true" : "false", r.ok ? "true" : "false",
+				 r.setup * 1e3, r.fps, r.lat[0] * 1e3, r.lat[1] * 1e3,
+				 r.lat[2] * 1e3, r.lat[3] * 1e3, r.cpu * 1e3);
+		else
+			fprintf (fp, "%s,%d,%d,%s,%s,%d,%d,%s,%d,%d,%.3f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+				 c->in_size, c->win, c->hin, c->in_ext,
+				 show_size (c->wout, c->hout), c->wout, c->hout, c->out_ext,
+				 c->scaled, r.ok, r.setup * 1e3, r.fps, r.lat[0] * 1e3,
+				 r.lat[1] * 1e3, r.lat[2] * 1e3, r.lat[3] * 1e3, r.cpu * 1e3);
+		fflush (fp);
+		first = 0;
+	}
+
+	if (json)
+		fprintf (fp, "\n]\n");
+	fclose (fp);
+	free (cases);
+}
+
+/*
+ * Golden-output regression over the bench cases, fed with fill_pattern().
+ * Without 'name' on disk the results are recorded there; otherwise every
+ * case must still produce them and must not lose more than 'tolerance'
+ * percent of its recorded frame rate or add as much to its p50 and p99
+ * latency.
+ *
+ * Unscaled cases must reproduce the checksum of all their output. The
+ * UDS output is kept whole in name.d/ and each plane is compared sample
+ * by sample, over all frames, with what was recorded there. The RMS it
+ * may differ by is what a second run of the case differed by at
+ * recording time, so it is zero when the converter is deterministic and
+ * the golden output has to be matched exactly.
+ */
+static int
+run_regress                     (char *name)
+{
+	struct bench_desc *cases, *c;
+	struct bench_result r, again;
+	char line[256], in_size[16], in_ext[16], out_size[16], out_ext[16], ok[8];
+	char golden[256], output[264];
+	char *opt = strrchr (name, ':');
+	double tolerance = 10.0, rms = 0.0, g_rms, g_fps, g_p50, g_p99;
+	unsigned long long g_hash;
+	int i, n, scaled, found, record, passed = 0, failed = 0;
+	FILE *fp;
+
+	if (opt) {
+		*opt++ = '\0';
+		tolerance = strtod (opt, NULL);
+	}
+
+	regress = 1;
+	record = access (name, F_OK) != 0;
+	if ((fp = fopen (name, record ? "w" : "r")) == NULL)
+		errno_exit ("cannot open ", name);
+	snprintf (golden, sizeof(golden), "%s.d", name);
+	if (record && mkdir (golden, 0755) < 0 && errno != EEXIST)
+		errno_exit ("cannot create ", golden);
+	if (record)
+		fprintf (fp, "# in_size in_fmt out_size out_fmt uds ok checksum rms fps "
+			 "lat_p50_ms lat_p99_ms (%u frames, %s)\n",
+			 frame_count, sw_device ? "software" : "VSP");
+
+	n = bench_cases (&cases);
+	for (i = 0; i < n; i++) {
+		c = &cases[i];
+		snprintf (golden, sizeof(golden), "%s.d/%s-%s-%s-%s.raw", name,
+			  c->in_size, c->in_ext, show_size (c->wout, c->hout), c->out_ext);
+		snprintf (output, sizeof(output), "%s.new", golden);
+
+		if (record) {
+			bench_case (c, &r, c->scaled ? golden : NULL);
+			rms = 0.0;
+			if (c->scaled && r.ok) {
+				bench_case (c, &again, output);
+				rms = again.ok ? golden_rms (output, golden, &r.fmt) : -1.0;
+				unlink (output);
+				if (rms < 0.0) {
+					printf("%-5s %-7s -> %-5s %-7s uds: second run failed\n",
+					       c->in_size, c->in_ext, show_size (c->wout, c->hout),
+					       c->out_ext);
+					r.ok = 0;
+					rms = 0.0;
+				}
+			}
+			fprintf (fp, "%s %s %s %s %d %s %016llx %.3f %.2f %.3f %.3f\n",
+				 c->in_size, c->in_ext, show_size (c->wout, c->hout),
+				 c->out_ext, c->scaled, r.ok ? "ok" : "failed",
+				 (unsigned long long)r.hash, rms, r.fps,
+				 r.lat[0] * 1e3, r.lat[2] * 1e3);
+			fflush (fp);
+			printf("%-5s %-7s -> %-5s %-7s %s: recorded %016llx %.1f fps\n",
+			       c->in_size, c->in_ext, show_size (c->wout, c->hout),
+			       c->out_ext, c->scaled ? "uds" : "   ",
+			       (unsigned long long)r.hash, r.fps);
+			continue;
+		}
+
+		found = 0;
+		rewind (fp);
+		while (fgets (line, sizeof(line), fp)) {
+			if (line[0] == '#' ||
+			    sscanf (line, "%15s %15s %15s %15s %d %7s %llx %lf %lf %lf %lf",
+				    in_size, in_ext, out_size, out_ext, &scaled, ok,
+				    &g_hash, &g_rms, &g_fps, &g_p50, &g_p99) != 11)
+				continue;
+			if (!strcmp (in_size, c->in_size) && !strcmp (in_ext, c->in_ext) &&
+			    !strcmp (out_size, show_size (c->wout, c->hout)) &&
+			    !strcmp (out_ext, c->out_ext) && scaled == c->scaled) {
+				found = 1;
+				break;
+			}
+		}
+
+		if (found) {
+			bench_case (c, &r, c->scaled ? output : NULL);
+			rms = (c->scaled && r.ok) ? golden_rms (output, golden, &r.fmt) : 0.0;
+		}
+
+		printf("%-5s %-7s -> %-5s %-7s %s: ",
+		       c->in_size, c->in_ext, show_size (c->wout, c->hout),
+		       c->out_ext, c->scaled ? "uds" : "   ");
+		if (!found) {
+			printf("FAIL, not in %s\n", name);
+			failed++;
+		} else if (!strcmp (ok, "ok") && !r.ok) {
+			printf("FAIL, the case no longer runs\n");
+			failed++;
+		} else if (!r.ok) {
+			printf("skipped, failed when recorded\n");
+		} else if (c->scaled && rms < 0.0) {
+			printf("FAIL, no golden output %s of this length\n", golden);
+			failed++;
+		} else if (c->scaled && rms > g_rms) {
+			printf("FAIL, RMS %.3f from the golden output > %.3f, kept in %s\n",
+			       rms, g_rms, output);
+			failed++;
+			continue;
+		} else if (!c->scaled && r.hash != g_hash) {
+			printf("FAIL, checksum %016llx != %016llx\n",
+			       (unsigned long long)r.hash, g_hash);
+			failed++;
+		} else if (r.fps < g_fps * (1.0 - tolerance / 100.0)) {
+			printf("FAIL, %.1f fps < %.1f fps - %.0f%%\n",
+			       r.fps, g_fps, tolerance);
+			failed++;
+		} else if (r.lat[0] * 1e3 > g_p50 * (1.0 + tolerance / 100.0) ||
+			   r.lat[2] * 1e3 > g_p99 * (1.0 + tolerance / 100.0)) {
+			printf("FAIL, latency p50 %.3f p99 %.3f ms > %.3f %.3f ms + %.0f%%\n",
+			       r.lat[0] * 1e3, r.lat[2] * 1e3, g_p50, g_p99, tolerance);
+			failed++;
+		} else {
+			printf("ok %.1f fps (%+.1f%%), p99 %.3f ms\n", r.fps,
+			       g_fps > 0.0 ? (r.fps / g_fps - 1.0) * 100.0 : 0.0,
+			       r.lat[2] * 1e3);
+			passed++;
 		}
+		if (c->scaled)
+			unlink (output);
 	}
 
-	return -1;
+	fclose (fp);
+	free (cases);
+
+	if (record) {
+		printf("%d cases recorded to %s\n", n, name);
+		return 0;
+	}
+	printf("regression: %d passed, %d failed\n", passed, failed);
+	return failed ? -1 : 0;
 }
 
-static const char * show_colorspace (uint32_t c)
+/*
+ * VSP instances with a video node on rpf.0 and on wpf.0 and a media
+ * device, found through the names sysfs gives the video nodes
+ * ("<ip> <entity> input|output").
+ */
+static int
+discover_instances              (char *out_dev[], char *cap_dev[], int max)
 {
-	int nr_exts = sizeof(exts) / sizeof(exts[0]);
-	int i;
+	char ips[MAX_SHARDS][64], path[256], name[256], ip[64], ent[32];
+	int outs[MAX_SHARDS], caps[MAX_SHARDS];
+	int i, j, n = 0, found = 0, fd;
+
+	for (i = 0; i < 256; i++) {
+		snprintf (path, sizeof(path), "/sys/class/video4linux/video%d/name", i);
+		if (fgets_with_openclose (path, name, sizeof(name)) < 0 ||
+		    sscanf (name, "%63s %31s", ip, ent) != 2)
+			continue;
+		if (strcmp (ent, "rpf.0") && strcmp (ent, "wpf.0"))
+			continue;
+		for (j = 0; j < n && strcmp (ips[j], ip); j++)
+			;
+		if (j == n) {
+			if (n == MAX_SHARDS)
+				continue;
+			strcpy (ips[n], ip);
+			outs[n] = caps[n] = -1;
+			n++;
+		}
+		if (!strcmp (ent, "rpf.0"))
+			outs[j] = i;
+		else
+			caps[j] = i;
+	}
 
-	for (i=0; i<nr_exts; i++) {
-		if (c == exts[i].fourcc)
-			return exts[i].ext;
+	for (j = 0; j < n && found < max; j++) {
+		if (outs[j] < 0 || caps[j] < 0)
+			continue;
+		fd = open_media_device (ips[j]);
+		if (fd < 0)
+			continue;
+		close (fd);
+		out_dev[found] = malloc (32);
+		cap_dev[found] = malloc (32);
+		sprintf (out_dev[found], "/dev/video%d", outs[j]);
+		sprintf (cap_dev[found], "/dev/video%d", caps[j]);
+		printf("shard %d: %s (%s -> %s)\n", found, ips[j],
+		       out_dev[found], cap_dev[found]);
+		found++;
 	}
 
-	return "<Unknown colorspace>";
+	return found;
+}
+
+/*
+ * Split -n frames over the instances, one child process each, and merge
+ * the outputs in place: every frame is read from and written to its
+ * offset in the files, so no reordering is needed afterwards.
+ */
+static void
+run_shards                      (void)
+{
+	char *out_dev[MAX_SHARDS], *cap_dev[MAX_SHARDS];
+	pid_t pid[MAX_SHARDS];
+	unsigned int count[MAX_SHARDS], total = frame_count;
+	int i, n, status, null_fd, failed = 0;
+	double t;
+
+	/*
+	 * --live drops frames by advancing the input, which the shards index
+	 * directly; -p and -w are given in absolute frames, but a shard counts
+	 * its own, and a switch changes the frame size the offsets assume.
+	 */
+	if (direct_io || histo_name || delta || live_fps > 0.0 || n_params || n_switches) {
+		fprintf (stderr, "--shard can't be combined with --direct, --histogram, --delta, "
+			 "--live, --params or --switch\n");
+		exit (EXIT_FAILURE);
+	}
+	if (output_fd >= 0 && !out_stream.seekable) {
+		fprintf (stderr, "--shard writes the output out of order, it must be a file\n");
+		exit (EXIT_FAILURE);
+	}
+
+	if (sw_device) {
+		n = (n_shards > 0) ? n_shards : sysconf (_SC_NPROCESSORS_ONLN);
+		if (n > MAX_SHARDS)
+			n = MAX_SHARDS;
+	} else {
+		n = discover_instances (out_dev, cap_dev, MAX_SHARDS);
+		if (n_shards > 0 && n_shards < n)
+			n = n_shards;
+	}
+	if (n <= 0) {
+		fprintf (stderr, "no VSP instance to shard over\n");
+		exit (EXIT_FAILURE);
+	}
+	if ((unsigned int)n > total)
+		n = total;
+
+	t = gettimeofday_sec ();
+	fflush (stdout);
+	for (i = 0; i < n; i++) {
+		count[i] = shard_rr ? (total - i + n - 1) / n
+				    : (i + 1) * total / n - i * total / n;
+		pid[i] = fork ();
+		if (pid[i] < 0)
+			errno_exit ("fork for shard", NULL);
+		if (pid[i])
+			continue;
+
+		null_fd = open ("/dev/null", O_WRONLY);
+		dup2 (null_fd, STDOUT_FILENO);
+		shard_id = i;
+		shard_total = n;
+		pool_budget /= n;	/* the budget is for all shards together */
+		shard_first = i * total / n;
+		frame_count = count[i];
+		if (!sw_device) {
+			dev_name[OUT] = out_dev[i];
+			dev_name[CAP] = cap_dev[i];
+		}
+		if (sw_device)
+			run_sw ();
+		else
+			run_pipeline ();
+		fflush (stdout);
+		_exit (EXIT_SUCCESS);
+	}
+
+	for (i = 0; i < n; i++) {
+		waitpid (pid[i], &status, 0);
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS) {
+			fprintf (stderr, "shard %d failed\n", i);
+			failed = 1;
+		}
+	}
+	t = gettimeofday_sec () - t;
+
+	printf("%u frames over %d shard(s) (%s) in %.3f s, %.1f fps\n",
+	       total, n, shard_rr ? "round-robin" : "ranges", t, total / t);
+	if (failed)
+		exit (EXIT_FAILURE);
+}
+
+static void
+add_switch                      (char *arg)
+{
+	struct format_switch sw;
+	char *size, *color;
+
+	CLEAR (sw);
+	sw.format = format[OUT];
+	sw.code = code[OUT];
+	sw.n_planes = n_planes[OUT];
+
+	size = strchr (arg, ':');
+	if (!size)
+		goto err;
+	*size++ = '\0';
+	color = strchr (size, ':');
+	if (color)
+		*color++ = '\0';
+
+	sw.frame = strtoul (arg, NULL, 0);
+	if (set_size (size, &sw.width, &sw.height) < 0)
+		goto err;
+	if (color && set_colorspace (color, &sw.format, &sw.code, &sw.n_planes) < 0)
+		goto err;
+	if (n_switches && sw.frame <= switches[n_switches - 1].frame)
+		goto err;
+
+	switches = realloc (switches, sizeof(sw) * (n_switches + 1));
+	switches[n_switches++] = sw;
+	return;
+
+err:
+	fprintf (stderr, "invalid format switch: %s\n", arg);
+	exit (EXIT_FAILURE);
 }
 
 int
 main                            (int                    argc,
                                  char **                argv)
 {
-	int ret;
-	char tmp[256];
+	char *bench_name = NULL;
+	char *regress_name = NULL;
+	char *input_name = NULL, *output_name = NULL;
 
         dev_name[0] = "/dev/video0";
         dev_name[1] = "/dev/video1";
@@ -978,7 +5808,14 @@ main                            (int                    argc,
                         exit (EXIT_SUCCESS);
 
 		case 'c': /* input colorspace */
-			set_colorspace (optarg, &format[OUT], &code[OUT], &n_planes[OUT]);
+			if (set_colorspace (optarg, &format[OUT], &code[OUT], &n_planes[OUT]) < 0 &&
+			    (repack_fmt = find_repack (optarg))) {
+				format[OUT] = repack_fmt->fourcc;
+				code[OUT] = repack_fmt->code;
+				n_planes[OUT] = repack_fmt->n_planes;
+				printf("%s input is repacked to %s\n", repack_fmt->name,
+				       show_colorspace (format[OUT]));
+			}
 			break;
 
 		case 's': /* input size */
@@ -1002,122 +5839,200 @@ main                            (int                    argc,
                         break;
 
                 case 'f':
-                        input_fd = open(optarg, O_RDONLY);
+                        input_name = optarg;
                         break;
 
                 case 'F':
-                        output_fd = open(optarg, O_WRONLY | O_CREAT, 0644);
+                        output_name = optarg;
                         break;
 
-                default:
-                        usage (stderr, argc, argv);
-                        exit (EXIT_FAILURE);
-                }
-        }
+		case 'p':
+			load_params (optarg);
+			break;
 
-        v4lout_fd = open_device (dev_name[OUT]);
-        v4lcap_fd = open_device (dev_name[CAP]);
+		case 'r':
+			use_requests = 1;
+			break;
 
-#if 1
-	list_formats(v4lout_fd, OUT,
-		     V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-	list_formats(v4lcap_fd, CAP,
-		     V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
-#endif
-        init_device (v4lout_fd, OUT,
-		     V4L2_CAP_VIDEO_OUTPUT_MPLANE,
-		     V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+		case 'w':
+			add_switch (optarg);
+			break;
 
-        init_device (v4lcap_fd, CAP,
-		     V4L2_CAP_VIDEO_CAPTURE_MPLANE,
-		     V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
-	media_fd = open_media_device (ip_name);
-	if (media_fd < 0)
-		errno_exit ("cannot open a media file for ", ip_name);
+		case 'j':
+			n_workers = strtoul (optarg, NULL, 0);
+			if (n_workers > MAX_CPU_WORKERS)
+				n_workers = MAX_CPU_WORKERS;
+			break;
 
-	sprintf(tmp, "%s %s", ip_name, entity_name[OUT]);
-	ret = get_media_entity (tmp, &entity[OUT]);
-	printf("ret = %d, entity[OUT] = %s\n", ret, entity[OUT].name);
-	sprintf(tmp, "%s %s", ip_name, entity_name[CAP]);
-	ret = get_media_entity (tmp, &entity[CAP]);
-	printf("ret = %d, entity[CAP] = %s\n", ret, entity[CAP].name);
+		case 'b':
+			latency_budget = strtod (optarg, NULL) * 1e-3;
+			break;
 
-	/* Deactivate the current pipeline. */
-	deactivate_link (&entity[OUT]);
+		case 'n':
+			frame_count = strtoul (optarg, NULL, 0);
+			break;
 
-	if ((width[OUT] != width[CAP]) || (height[OUT] != height[CAP])) {
-		char path[256];
+		case 'x':
+			sw_device = 1;
+			break;
 
-		v4lsub_fd[RESZ] = open_v4lsubdev (ip_name, entity_name[RESZ], path);
-		if (v4lsub_fd[RESZ] < 0)
-			errno_exit("cannot open a subdev file for ", entity_name[RESZ]);
+		case 'B':
+			bench_name = optarg;
+			break;
 
-		sprintf(tmp, "%s %s", ip_name, entity_name[RESZ]);
-		ret = get_media_entity (tmp, &entity[RESZ]);
-		if (ret < 0) {
-			fprintf(stderr, "Entity for %s not found.\n", entity_name[RESZ]);
-			exit (EXIT_FAILURE);
-		}
-		printf("A entity for %s found.\n", entity_name[RESZ]);
-		ret = activate_link (&entity[OUT], &entity[RESZ]);
-		if (ret) {
-			fprintf(stderr, "Cannot enable a link from %s to %s\n",
-				entity_name[OUT], entity_name[RESZ]);
-			exit (EXIT_FAILURE);
-		}
-		printf("A link from %s to %s enabled.\n",
-		       entity_name[OUT], entity_name[RESZ]);
-		ret = activate_link (&entity[RESZ], &entity[CAP]);
-		if (ret) {
-			fprintf(stderr, "Cannot enable a link from %s to %s\n",
-				entity_name[RESZ], entity_name[CAP]);
-			exit (EXIT_FAILURE);
-		}
-		printf("A link from %s to %s enabled.\n",
-		       entity_name[RESZ], entity_name[CAP]);
-		init_entity_pad (v4lsub_fd[RESZ], RESZ, 0, width[OUT], height[OUT], code[CAP]);
-		init_entity_pad (v4lsub_fd[RESZ], RESZ, 1, width[CAP], height[CAP], code[CAP]);
-	} else {
-		ret = activate_link (&entity[OUT], &entity[CAP]);
-		if (ret) {
-			fprintf(stderr, "Cannot enable a link from %s to %s\n",
-			       entity_name[OUT], entity_name[CAP]);
-			exit (EXIT_FAILURE);
-		}
-		printf("A link from %s to %s enabled.\n",
-		       entity_name[OUT], entity_name[CAP]);
-	}
+		case 'g':
+			regress_name = optarg;
+			break;
 
-	/* sink pad in RPF */
-	init_entity_pad (v4lsub_fd[OUT], OUT, 0, width[OUT], height[OUT], code[OUT]);
-	/* source pad in RPF */
-	init_entity_pad (v4lsub_fd[OUT], OUT, 1, width[OUT], height[OUT], code[CAP]);
-	/* sink pad in WPF */
-	init_entity_pad (v4lsub_fd[CAP], CAP, 0, width[CAP], height[CAP], code[CAP]);
-	/* source pad in WPF */
-	init_entity_pad (v4lsub_fd[CAP], CAP, 1, width[CAP], height[CAP], code[CAP]);
+		case 'y':
+			histo_name = optarg;
+			break;
 
-        queue_buffers (v4lout_fd, OUT,
-		       V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-        queue_buffers (v4lcap_fd, CAP,
-		       V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
-        start_capturing (v4lout_fd, OUT,
-			 V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-        start_capturing (v4lcap_fd, CAP,
-			 V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+		case 'M':
+			io = IO_METHOD_DMABUF;
+			pool_budget = strtoul (optarg, NULL, 0) << 20;
+			break;
 
-        mainloop ();
+		case 'm':
+			if (!strncmp (optarg, "rr:", 3)) {
+				shard_rr = 1;
+				optarg += 3;
+			}
+			n_shards = strcmp (optarg, "auto") ? atoi (optarg) : -1;
+			if (!n_shards) {
+				fprintf (stderr, "--shard needs a count or 'auto'\n");
+				exit (EXIT_FAILURE);
+			}
+			break;
 
-        stop_capturing (v4lout_fd, OUT,
-			V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
-        stop_capturing (v4lcap_fd, CAP,
-			V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+		case 'a':
+			if (parse_cpus (optarg, &main_cpus) < 0) {
+				fprintf (stderr, "invalid CPU list\n");
+				exit (EXIT_FAILURE);
+			}
+			main_pinned = rt_report = 1;
+			break;
 
-        uninit_device (OUT);
-        uninit_device (CAP);
+		case 'A':
+			if (parse_cpus (optarg, &worker_cpus) < 0) {
+				fprintf (stderr, "invalid CPU list\n");
+				exit (EXIT_FAILURE);
+			}
+			worker_pinned = rt_report = 1;
+			break;
 
-        close_device (v4lout_fd, OUT);
-        close_device (v4lcap_fd, CAP);
+		case 'P':
+			if (parse_sched (optarg) < 0) {
+				fprintf (stderr, "invalid scheduling policy\n");
+				exit (EXIT_FAILURE);
+			}
+			rt_report = 1;
+			break;
+
+		case 'L':
+			lock_memory = rt_report = 1;
+			break;
+
+		case 'o':
+			direct_io = 1;
+			break;
+
+		case 'R':
+			readahead_window = strtoul (optarg, NULL, 0) * 1024;
+			break;
+
+		case 'T':
+			open_trace ();
+			break;
+
+		case 'u':
+			init_lut (optarg);
+			break;
+
+		case 'z':
+			delta = 1;
+			break;
+
+		case 'k':
+			metrics_name = optarg;
+			break;
+
+		case 'e':
+			dedup = 1;
+			break;
+
+		case 'l':
+			live_fps = strtod (optarg, NULL);
+			if (live_fps <= 0.0) {
+				fprintf (stderr, "live frame rate must be positive\n");
+				exit (EXIT_FAILURE);
+			}
+			break;
+
+		case 't':
+			rotation = atoi (optarg);
+			if (rotation != 0 && rotation != 90 &&
+			    rotation != 180 && rotation != 270) {
+				fprintf (stderr, "rotation must be 0, 90, 180 or 270\n");
+				exit (EXIT_FAILURE);
+			}
+			break;
+
+		case 'H':
+			hflip = 1;
+			break;
+
+		case 'V':
+			vflip = 1;
+			break;
+
+                default:
+                        usage (stderr, argc, argv);
+                        exit (EXIT_FAILURE);
+                }
+        }
+
+	/* the CPU paths only have the 1D LUT, on RGB like the VSP's ARGB pipeline */
+	if (lut_entries && (n_workers || sw_device) &&
+	    (lut_entries != LUT_SIZE || code[CAP] != V4L2_MBUS_FMT_ARGB8888_1X32)) {
+		fprintf (stderr, "-u with -j or -x needs a 1D LUT and RGB output\n");
+		exit (EXIT_FAILURE);
+	}
+	if (repack_fmt && direct_io) {
+		fprintf (stderr, "%s input can't be repacked with --direct\n", repack_fmt->name);
+		exit (EXIT_FAILURE);
+	}
+	if (input_name)
+		input_fd = open_stream (&in_stream, input_name, 0);
+	if (output_name)
+		output_fd = open_stream (&out_stream, output_name, 1);
+
+	if (metrics_name) {
+		open_metrics (metrics_name);
+		METRIC_SET (pool_budget, pool_budget);
+	}
+
+	setup_realtime ();
+
+	if (regress_name) {
+		if (run_regress (regress_name) < 0)
+			exit (EXIT_FAILURE);
+	} else if (bench_name)
+		run_bench (bench_name);
+	else if (n_shards)
+		run_shards ();
+	else if (sw_device)
+		run_sw ();
+	else
+		run_pipeline ();
+
+	if (delta && out_stream.bytes)
+		printf("delta: %.1f MB of frames written as %.1f MB (%.1f%%)\n",
+		       delta_raw / 1e6, out_stream.bytes / 1e6,
+		       delta_raw ? out_stream.bytes * 100.0 / delta_raw : 0.0);
+	close_stream (&in_stream, "input");
+	close_stream (&out_stream, "output");
+	close_metrics ();
 
         exit (EXIT_SUCCESS);
 
@@ -0,0 +1,100 @@
+/*
+ *  Decode the output of v4l2m2m_vsp --delta back to raw frames
+ *
+ *  vsp-delta-decode in.vspd out.raw
+ *
+ *  Either name may be "-" for stdin/stdout.
+ *
+ *  This program can be used and distributed without restrictions.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "vsp_delta.h"
+
+static void
+errno_exit                      (const char *           s, const char *s2)
+{
+	if (s2)
+		fprintf (stderr, "%s%s error %d, %s\n",
+			 s, s2, errno, strerror (errno));
+	else
+		fprintf (stderr, "%s error %d, %s\n",
+			 s, errno, strerror (errno));
+
+        exit (EXIT_FAILURE);
+}
+
+int
+main                            (int                    argc,
+                                 char **                argv)
+{
+	struct vsp_delta_hdr hdr;
+	uint8_t *frame = NULL, *enc = NULL;
+	size_t frame_len = 0, enc_size = 0;
+	unsigned int frames = 0;
+	uint64_t in_bytes = 0, out_bytes = 0;
+	FILE *in, *out;
+
+	if (argc != 3) {
+		fprintf (stderr, "Usage: %s in.vspd out.raw\n", argv[0]);
+		exit (EXIT_FAILURE);
+	}
+
+	in = strcmp (argv[1], "-") ? fopen (argv[1], "rb") : stdin;
+	if (!in)
+		errno_exit ("cannot open ", argv[1]);
+	out = strcmp (argv[2], "-") ? fopen (argv[2], "wb") : stdout;
+	if (!out)
+		errno_exit ("cannot open ", argv[2]);
+
+	while (fread (&hdr, sizeof(hdr), 1, in) == 1) {
+		if (hdr.magic != VSP_DELTA_MAGIC) {
+			fprintf (stderr, "frame %u: bad magic\n", frames);
+			exit (EXIT_FAILURE);
+		}
+
+		/* a new frame size starts again from an all-zero frame */
+		if (hdr.raw_len != frame_len) {
+			free (frame);
+			frame = calloc (1, hdr.raw_len);
+			if (!frame)
+				errno_exit ("cannot allocate a frame", NULL);
+			frame_len = hdr.raw_len;
+		}
+		if (hdr.enc_len > enc_size) {
+			free (enc);
+			enc = malloc (enc_size = hdr.enc_len);
+			if (!enc)
+				errno_exit ("cannot allocate a record", NULL);
+		}
+
+		if (fread (enc, 1, hdr.enc_len, in) != hdr.enc_len) {
+			fprintf (stderr, "frame %u (seq %u): truncated\n", frames, hdr.seq);
+			exit (EXIT_FAILURE);
+		}
+		if (vsp_delta_decode (enc, hdr.enc_len, frame, frame_len) < 0) {
+			fprintf (stderr, "frame %u (seq %u): corrupt\n", frames, hdr.seq);
+			exit (EXIT_FAILURE);
+		}
+		if (fwrite (frame, 1, frame_len, out) != frame_len)
+			errno_exit ("write to ", argv[2]);
+
+		in_bytes += sizeof(hdr) + hdr.enc_len;
+		out_bytes += frame_len;
+		frames++;
+	}
+	if (ferror (in))
+		errno_exit ("read from ", argv[1]);
+	if (fclose (out))
+		errno_exit ("close ", argv[2]);
+
+	fprintf (stderr, "%u frames, %.1f MB from %.1f MB\n",
+		 frames, out_bytes / 1e6, in_bytes / 1e6);
+
+	return 0;
+}
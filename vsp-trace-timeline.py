@@ -0,0 +1,106 @@
+#!/usr/bin/env python3
+#
+#  Turn an ftrace dump taken while running v4l2m2m_vsp -T into a per-frame
+#  timeline.
+#
+#  echo 1 > /sys/kernel/tracing/tracing_on
+#  ./v4l2m2m_vsp -T ...
+#  cat /sys/kernel/tracing/trace > trace.txt
+#  ./vsp-trace-timeline.py trace.txt
+#
+#  For each frame (sequence number) it prints, relative to the frame's
+#  input read, when the read finished, when the OUT buffer was queued,
+#  when the VSP returned it (CAP dequeued) and when the output was written,
+#  followed by the per-stage averages and maxima. Other trace events (e.g.
+#  vsp1 interrupts or v4l2 tracepoints) that fall inside a frame's
+#  queue-to-dequeue window are counted in the "kernel" column.
+#
+#  This program can be used and distributed without restrictions.
+#
+
+import re
+import sys
+
+MARK = re.compile(r'\s(\d+\.\d+):\s+tracing_mark_write:\s+vsp_(\w+) q=(\S+) idx=(-?\d+) seq=(-?\d+)')
+STAMP = re.compile(r'\s(\d+\.\d+):\s+(\S+):')
+
+STAGES = [
+    ('read',  'read_begin',  'read_end'),
+    ('queue', 'read_end',    'qbuf'),
+    ('vsp',   'qbuf',        'dqbuf_cap'),
+    ('emit',  'dqbuf_cap',   'write_begin'),
+    ('write', 'write_begin', 'write_end'),
+]
+
+
+def parse(lines):
+    frames = {}
+    others = []
+    for line in lines:
+        m = MARK.search(line)
+        if m:
+            t, ev, q, idx, seq = m.groups()
+            seq = int(seq)
+            if seq < 0:
+                continue
+            if ev in ('qbuf', 'dqbuf'):
+                if q != 'OUT' and ev == 'qbuf':
+                    continue
+                if ev == 'dqbuf':
+                    ev = 'dqbuf_' + q.lower()
+            frames.setdefault(seq, {}).setdefault(ev, float(t))
+            continue
+        m = STAMP.search(line)
+        if m and not line.lstrip().startswith('#'):
+            others.append(float(m.group(1)))
+    return frames, others
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.stderr.write('usage: %s trace.txt\n' % sys.argv[0])
+        return 1
+
+    with open(sys.argv[1]) as fp:
+        frames, others = parse(fp)
+    if not frames:
+        sys.stderr.write('no vsp_* events found\n')
+        return 1
+
+    others.sort()
+    stats = dict((name, []) for name, _, _ in STAGES)
+
+    print('%6s %9s' % ('seq', 'start') +
+          ''.join('%9s' % name for name, _, _ in STAGES) + '%9s %7s' % ('total', 'kernel'))
+    for seq in sorted(frames):
+        f = frames[seq]
+        t0 = f.get('read_begin', f.get('qbuf'))
+        if t0 is None:
+            continue
+        row = '%6d %9.3f' % (seq, t0 * 1e3)
+        for name, a, b in STAGES:
+            if a in f and b in f:
+                d = (f[b] - f[a]) * 1e3
+                stats[name].append(d)
+                row += '%9.3f' % d
+            else:
+                row += '%9s' % '-'
+        end = f.get('write_end', f.get('dqbuf_cap'))
+        row += '%9.3f' % ((end - t0) * 1e3) if end else '%9s' % '-'
+        if 'qbuf' in f and 'dqbuf_cap' in f:
+            row += ' %7d' % sum(1 for t in others if f['qbuf'] <= t <= f['dqbuf_cap'])
+        else:
+            row += ' %7s' % '-'
+        print(row)
+
+    print()
+    for name, _, _ in STAGES:
+        v = stats[name]
+        if v:
+            print('%-6s avg %8.3f ms  max %8.3f ms  (%d frames)' %
+                  (name, sum(v) / len(v), max(v), len(v)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,119 @@
+/*
+ *  Delta/RLE output format of v4l2m2m_vsp --delta
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ *  The file is a sequence of records, one per output frame:
+ *
+ *	struct vsp_delta_hdr
+ *	enc_len bytes of tokens
+ *
+ *  A frame is coded in VSP_DELTA_BLOCK byte blocks against the frame
+ *  before it (all zeroes for the first frame, and again whenever the
+ *  frame size changes). Each token is a LEB128 varint, (n << 2) | op:
+ *
+ *	VSP_DELTA_SKIP	n blocks unchanged from the previous frame
+ *	VSP_DELTA_FILL	n copies of the block just before
+ *	VSP_DELTA_COPY	n blocks follow verbatim
+ *
+ *  The raw_len % VSP_DELTA_BLOCK bytes of the tail follow the last token
+ *  verbatim.
+ */
+
+#ifndef VSP_DELTA_H
+#define VSP_DELTA_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define VSP_DELTA_MAGIC		0x44505356	/* "VSPD" */
+#define VSP_DELTA_BLOCK		16
+
+enum {
+	VSP_DELTA_SKIP	= 0,
+	VSP_DELTA_FILL	= 1,
+	VSP_DELTA_COPY	= 2,
+};
+
+struct vsp_delta_hdr {
+	uint32_t magic;
+	uint32_t seq;		/* output frame number */
+	uint32_t raw_len;	/* decoded frame size */
+	uint32_t enc_len;	/* token bytes after this header */
+};
+
+/* worst case of enc_len: a token between every two blocks */
+static inline size_t
+vsp_delta_bound                 (size_t raw_len)
+{
+	return raw_len + (raw_len / VSP_DELTA_BLOCK + 1) * 5;
+}
+
+static inline uint8_t *
+vsp_delta_put                   (uint8_t *d, uint32_t n, int op)
+{
+	uint64_t v = ((uint64_t)n << 2) | op;
+
+	while (v >= 0x80) {
+		*d++ = v | 0x80;
+		v >>= 7;
+	}
+	*d++ = v;
+	return d;
+}
+
+/*
+ * Decode one record in place: 'frame' holds the previous frame on entry
+ * and the new one on return. Returns 0, or -1 on a corrupt record.
+ */
+static inline int
+vsp_delta_decode                (const uint8_t *s, size_t enc_len, uint8_t *frame, size_t raw_len)
+{
+	const uint8_t *end = s + enc_len;
+	size_t pos = 0, blocks = raw_len / VSP_DELTA_BLOCK * VSP_DELTA_BLOCK;
+	uint64_t v, n;
+	int shift, op;
+
+	while (pos < blocks) {
+		/* at most 5 bytes (35 bits), and the last one must end the token */
+		for (v = 0, shift = 0; ; shift += 7) {
+			if (s == end || shift >= 35)
+				return -1;
+			v |= (uint64_t)(*s & 0x7f) << shift;
+			if (!(*s++ & 0x80))
+				break;
+		}
+		op = v & 3;
+		n = (v >> 2) * VSP_DELTA_BLOCK;
+		if (!n || n > blocks - pos)
+			return -1;
+
+		switch (op) {
+		case VSP_DELTA_SKIP:
+			break;
+		case VSP_DELTA_FILL:
+			if (!pos)
+				return -1;
+			for (; n; n -= VSP_DELTA_BLOCK, pos += VSP_DELTA_BLOCK)
+				memcpy (frame + pos, frame + pos - VSP_DELTA_BLOCK, VSP_DELTA_BLOCK);
+			continue;
+		case VSP_DELTA_COPY:
+			if ((size_t)(end - s) < n)
+				return -1;
+			memcpy (frame + pos, s, n);
+			s += n;
+			break;
+		default:
+			return -1;
+		}
+		pos += n;
+	}
+
+	if ((size_t)(end - s) != raw_len - blocks)
+		return -1;
+	memcpy (frame + blocks, s, raw_len - blocks);
+
+	return 0;
+}
+
+#endif /* VSP_DELTA_H */
@@ -0,0 +1,129 @@
+/*
+ *  Live metrics of v4l2m2m_vsp --metrics
+ *
+ *  This program can be used and distributed without restrictions.
+ *
+ *  The converter keeps its counters in a shared memory page,
+ *  /dev/shm/vsp-<name>, and serves them in the Prometheus text format
+ *  on the abstract UNIX socket "vsp-<name>":
+ *
+ *	curl --abstract-unix-socket vsp-<name> http://localhost/metrics
+ *
+ *  The fields are only touched with relaxed atomics: the frame path
+ *  never takes a lock for them, and readers may see a snapshot that is
+ *  a frame or so apart between fields. vspstat shows them live.
+ */
+
+#ifndef VSP_METRICS_H
+#define VSP_METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define VSP_METRICS_MAGIC	0x4d505356	/* "VSPM" */
+#define VSP_METRICS_VERSION	1
+#define VSP_METRICS_SHM		"/vsp-%s"
+#define VSP_METRICS_SOCK	"vsp-%s"	/* abstract namespace */
+
+struct vsp_metrics {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			/* sizeof(struct vsp_metrics) */
+	int32_t pid;
+	uint64_t start_ns;		/* CLOCK_MONOTONIC */
+	uint64_t update_ns;		/* last frame written */
+
+	/* counters */
+	uint64_t frames_read;
+	uint64_t frames_written;
+	uint64_t frames_hw;
+	uint64_t frames_cpu;
+	uint64_t frames_dup;
+	uint64_t frames_dropped;
+	uint64_t recoveries;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t read_ns;
+	uint64_t convert_ns;
+	uint64_t write_ns;
+
+	/* gauges */
+	uint64_t hw_inflight;
+	uint64_t cpu_inflight;
+	uint64_t pending;
+	uint64_t pool_bytes;
+	uint64_t pool_budget;
+};
+
+static inline void
+vsp_metric_add                  (uint64_t *m, uint64_t v)
+{
+	__atomic_fetch_add (m, v, __ATOMIC_RELAXED);
+}
+
+static inline void
+vsp_metric_set                  (uint64_t *m, uint64_t v)
+{
+	__atomic_store_n (m, v, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+vsp_metric_get                  (const uint64_t *m)
+{
+	return __atomic_load_n (m, __ATOMIC_RELAXED);
+}
+
+static const struct {
+	const char *name;
+	const char *help;
+	int counter;
+	size_t offset;
+} vsp_metric_desc[] = {
+#define M(f, c, h)	{ #f, h, c, offsetof (struct vsp_metrics, f) }
+	M (frames_read,		1, "Input frames read"),
+	M (frames_written,	1, "Output frames written"),
+	M (frames_hw,		1, "Frames converted by the VSP"),
+	M (frames_cpu,		1, "Frames converted by the CPU"),
+	M (frames_dup,		1, "Duplicate input frames that repeated the last output"),
+	M (frames_dropped,	1, "Input frames dropped to keep up with --live"),
+	M (recoveries,		1, "Recoveries from streaming errors"),
+	M (bytes_read,		1, "Input bytes read"),
+	M (bytes_written,	1, "Output bytes produced"),
+	M (read_ns,		1, "Time spent reading input, ns"),
+	M (convert_ns,		1, "Time from submission to converted frame, ns"),
+	M (write_ns,		1, "Time spent writing output, ns"),
+	M (hw_inflight,		0, "Frames queued to the VSP"),
+	M (cpu_inflight,	0, "Frames queued to the CPU workers"),
+	M (pending,		0, "Converted frames waiting for their turn"),
+	M (pool_bytes,		0, "DMABUF pool allocation, bytes"),
+	M (pool_budget,		0, "DMABUF pool budget, bytes (0: unlimited)"),
+#undef M
+};
+
+/* the page in the Prometheus text exposition format; returns the length */
+static inline size_t
+vsp_metrics_format              (const struct vsp_metrics *m, char *buf, size_t size)
+{
+	size_t i, n = 0;
+	int r;
+
+	for (i = 0; i < sizeof(vsp_metric_desc) / sizeof(vsp_metric_desc[0]); i++) {
+		r = snprintf (buf + n, size - n,
+			      "# HELP vsp_%s%s %s\n# TYPE vsp_%s%s %s\nvsp_%s%s{pid=\"%d\"} %llu\n",
+			      vsp_metric_desc[i].name, vsp_metric_desc[i].counter ? "_total" : "",
+			      vsp_metric_desc[i].help,
+			      vsp_metric_desc[i].name, vsp_metric_desc[i].counter ? "_total" : "",
+			      vsp_metric_desc[i].counter ? "counter" : "gauge",
+			      vsp_metric_desc[i].name, vsp_metric_desc[i].counter ? "_total" : "",
+			      m->pid, (unsigned long long)vsp_metric_get (
+				      (const uint64_t *)((const char *)m + vsp_metric_desc[i].offset)));
+		if (r < 0 || (size_t)r >= size - n)
+			break;
+		n += r;
+	}
+
+	return n;
+}
+
+#endif /* VSP_METRICS_H */
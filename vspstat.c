@@ -0,0 +1,237 @@
+/*
+ *  Show the live counters of a v4l2m2m_vsp --metrics name run
+ *
+ *  vspstat [-i seconds] name	one line per interval from the shared page
+ *  vspstat -p name		one Prometheus snapshot from the socket
+ *
+ *  This program can be used and distributed without restrictions.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "vsp_metrics.h"
+
+static void
+errno_exit                      (const char *           s, const char *s2)
+{
+	if (s2)
+		fprintf (stderr, "%s%s error %d, %s\n",
+			 s, s2, errno, strerror (errno));
+	else
+		fprintf (stderr, "%s error %d, %s\n",
+			 s, errno, strerror (errno));
+
+        exit (EXIT_FAILURE);
+}
+
+static void
+usage                           (FILE *fp, char **argv)
+{
+	fprintf (fp,
+		 "Usage: %s [options] name\n\n"
+		 "-i | --interval s   Seconds between lines [1]\n"
+		 "-p | --prometheus   Print one snapshot from the metrics socket and exit\n"
+		 "-h | --help         Print this message\n"
+		 "",
+		 argv[0]);
+}
+
+static int
+print_prometheus                (const char *name)
+{
+	static const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	char buf[4096], *body;
+	ssize_t n;
+	int fd, in_body = 0;
+
+	memset (&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf (addr.sun_path + 1, sizeof(addr.sun_path) - 1, VSP_METRICS_SOCK, name);
+	addr_len = offsetof (struct sockaddr_un, sun_path) + 1 + strlen (addr.sun_path + 1);
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || -1 == connect (fd, (struct sockaddr *)&addr, addr_len))
+		errno_exit ("cannot connect to @", addr.sun_path + 1);
+	if (write (fd, req, sizeof(req) - 1) < 0)
+		errno_exit ("cannot send to @", addr.sun_path + 1);
+
+	/* skip the HTTP header */
+	while ((n = read (fd, buf, sizeof(buf) - 1)) > 0) {
+		buf[n] = '\0';
+		body = buf;
+		if (!in_body) {
+			body = strstr (buf, "\r\n\r\n");
+			if (!body)
+				continue;
+			body += 4;
+			in_body = 1;
+		}
+		fputs (body, stdout);
+	}
+	close (fd);
+
+	return in_body ? 0 : -1;
+}
+
+static uint64_t
+monotonic_ns                    (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#define GET(f)		vsp_metric_get (&m->f)
+#define DIFF(f)		(cur.f - last.f)
+
+static void
+watch                           (const char *name, double interval)
+{
+	const struct vsp_metrics *m;
+	struct vsp_metrics cur, last;
+	struct timespec ts;
+	char path[128];
+	uint64_t t, t_last, frames;
+	unsigned int lines = 0;
+	int fd;
+
+	snprintf (path, sizeof(path), VSP_METRICS_SHM, name);
+	fd = shm_open (path, O_RDONLY, 0);
+	if (fd < 0)
+		errno_exit ("cannot open the metrics page ", path);
+	m = mmap (NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+	if (MAP_FAILED == m)
+		errno_exit ("cannot map the metrics page ", path);
+	close (fd);
+
+	if (__atomic_load_n (&m->magic, __ATOMIC_ACQUIRE) != VSP_METRICS_MAGIC ||
+	    m->version != VSP_METRICS_VERSION || m->size != sizeof(*m)) {
+		fprintf (stderr, "%s: not a version %d metrics page\n", path, VSP_METRICS_VERSION);
+		exit (EXIT_FAILURE);
+	}
+
+	ts.tv_sec = (time_t)interval;
+	ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+	memset (&last, 0, sizeof(last));
+	t_last = m->start_ns;
+
+	for (;;) {
+		t = monotonic_ns ();
+		cur.frames_read = GET (frames_read);
+		cur.frames_written = GET (frames_written);
+		cur.frames_hw = GET (frames_hw);
+		cur.frames_cpu = GET (frames_cpu);
+		cur.frames_dup = GET (frames_dup);
+		cur.frames_dropped = GET (frames_dropped);
+		cur.recoveries = GET (recoveries);
+		cur.bytes_read = GET (bytes_read);
+		cur.bytes_written = GET (bytes_written);
+		cur.read_ns = GET (read_ns);
+		cur.convert_ns = GET (convert_ns);
+		cur.write_ns = GET (write_ns);
+
+		if (!(lines++ % 20))
+			printf("%7s %6s %6s %6s %8s %8s %8s %5s %5s %5s %3s %3s %4s %7s %7s %8s\n",
+			       "fps", "in", "out", "hw%", "read_ms", "conv_ms", "write_ms",
+			       "drop", "dup", "recov", "hwq", "cpq", "pend",
+			       "in_MB/s", "out_MB/s", "pool_MB");
+
+		frames = DIFF (frames_hw) + DIFF (frames_cpu);
+		printf("%7.1f %6llu %6llu %6.1f %8.3f %8.3f %8.3f %5llu %5llu %5llu %3llu %3llu %4llu %7.1f %7.1f %8.1f\n",
+		       DIFF (frames_written) * 1e9 / (t - t_last),
+		       (unsigned long long)DIFF (frames_read),
+		       (unsigned long long)DIFF (frames_written),
+		       frames ? DIFF (frames_hw) * 100.0 / frames : 0.0,
+		       DIFF (frames_read) ? DIFF (read_ns) / 1e6 / DIFF (frames_read) : 0.0,
+		       frames ? DIFF (convert_ns) / 1e6 / frames : 0.0,
+		       DIFF (frames_written) ? DIFF (write_ns) / 1e6 / DIFF (frames_written) : 0.0,
+		       (unsigned long long)DIFF (frames_dropped),
+		       (unsigned long long)DIFF (frames_dup),
+		       (unsigned long long)DIFF (recoveries),
+		       (unsigned long long)GET (hw_inflight),
+		       (unsigned long long)GET (cpu_inflight),
+		       (unsigned long long)GET (pending),
+		       DIFF (bytes_read) * 1e3 / (t - t_last),
+		       DIFF (bytes_written) * 1e3 / (t - t_last),
+		       GET (pool_bytes) / 1e6);
+		fflush (stdout);
+
+		/* the page outlives a converter that was killed */
+		if (lines > 1 && kill (m->pid, 0) < 0 && errno == ESRCH)
+			break;
+		last = cur;
+		t_last = t;
+		while (nanosleep (&ts, &ts) < 0 && errno == EINTR)
+			;
+		ts.tv_sec = (time_t)interval;
+		ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+	}
+}
+
+static const struct option
+long_options [] = {
+	{ "interval",	required_argument,	NULL,	'i' },
+	{ "prometheus",	no_argument,		NULL,	'p' },
+	{ "help",	no_argument,		NULL,	'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int
+main                            (int                    argc,
+                                 char **                argv)
+{
+	double interval = 1.0;
+	int prometheus = 0, c;
+
+	while ((c = getopt_long (argc, argv, "i:ph", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			interval = atof (optarg);
+			if (interval <= 0.0) {
+				fprintf (stderr, "bad interval %s\n", optarg);
+				exit (EXIT_FAILURE);
+			}
+			break;
+
+		case 'p':
+			prometheus = 1;
+			break;
+
+		case 'h':
+			usage (stdout, argv);
+			exit (EXIT_SUCCESS);
+
+		default:
+			usage (stderr, argv);
+			exit (EXIT_FAILURE);
+		}
+	}
+	if (optind + 1 != argc) {
+		usage (stderr, argv);
+		exit (EXIT_FAILURE);
+	}
+
+	if (prometheus)
+		return print_prometheus (argv[optind]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
+	watch (argv[optind], interval);
+
+	return 0;
+}